@@ -3,25 +3,97 @@
 //
 
 #include "fsm.hpp"
+#include <algorithm>
+#include <atomic>
+#include <string.h>
+#include <unordered_map>
 
 using namespace std;
 
 FSM::FSM() {
-  // TODO
+  state = -1;
+  default_state = -1;
+}
+
+FSM::FSM(const FSM& other) {
+  state = other.state;
+  default_state = other.default_state;
+  frozen = other.frozen;
+  reserve((int) other.states.size(), (int) other.transitions.size());
+  for (size_t i=0; i < other.states.size(); i++) {
+    states.push_back(state_pool.create(*other.states[i]));
+  }
+  for (size_t i=0; i < other.transitions.size(); i++) {
+    transitions.push_back(transition_pool.create(*other.transitions[i]));
+  }
+  transition_index = other.transition_index;
+}
+
+FSM::FSM(FSM&& other) {
+  state = -1;
+  default_state = -1;
+  swap(other);
+}
+
+FSM& FSM::operator = (FSM other) {
+  swap(other);
+  return *this;
+}
+
+FSM::~FSM() {
+  // the pools destroy the states and transitions themselves.
+}
+
+void FSM::swap(FSM& other) {
+  states.swap(other.states);
+  transitions.swap(other.transitions);
+  state_pool.swap(other.state_pool);
+  transition_pool.swap(other.transition_pool);
+  transition_index.swap(other.transition_index);
+  std::swap(state, other.state);
+  std::swap(default_state, other.default_state);
+  frozen.swap(other.frozen);
+}
+
+void FSM::reserve(int num_states, int num_transitions) {
+  if (num_states > 0) {
+    states.reserve(states.size() + num_states);
+    state_pool.reserve(num_states);
+  }
+  if (num_transitions > 0) {
+    transitions.reserve(transitions.size() + num_transitions);
+    transition_pool.reserve(num_transitions);
+    transition_index.reserve(transition_index.size() + num_transitions);
+  }
 }
 
 int FSM::addState(string label, bool is_accept_state) {
-  // TODO
-  return 0;
+  frozen.reset();
+  State* st = state_pool.create();
+  st->accept = is_accept_state;
+  st->label = label;
+  st->failure_trans = -1;
+  st->final_output = 0;
+  int id = (int) states.size();
+  states.push_back(st);
+  if (id == 0) {
+    state = id;
+    default_state = id;
+  }
+  return id;
 }
 
 int FSM::addState(string label) {
-  // TODO
-  return 0;
+  return addState(label, false);
 }
 
 int FSM::addTransition(int stateA, int stateB, 
 		       int signal, string transLabel) {
+  return addTransition(stateA, stateB, signal, transLabel, 0);
+}
+
+int FSM::addTransition(int stateA, int stateB, 
+		       int signal, string transLabel, uint64_t output) {
   // this method's documentation is longer than the implementation. to
   // help out, I'm including the comments for my implementation.
   //
@@ -31,70 +103,148 @@ int FSM::addTransition(int stateA, int stateB,
   // 2. get the State* for stateA and look for a duplicate
   // transition. if the new transition is FAILURE_SIGNAL, only need to
   // check the state's `failure_trans`. if it is a regular signal,
-  // need to look at each id in the state's `trans` vector. if there's
-  // a duplicate, return -1.
+  // look up (stateA, signal, stateB) in `transition_index` rather
+  // than scanning the state's `trans` vector. if there's a duplicate,
+  // return -1.
   //
   // 3. build a new Transition, and set its values.
   //
   // 4. add the new transition to the FSM and get its ID.
   //
   // 5. using the State* from step 2, use the new transition ID to
-  // either set the failure_trans or add to the trans list.
+  // either set the failure_trans or add to the trans list (and the
+  // index).
   //
   // 6. return the new transition's ID.
 
-  // TODO
-  return 0;
+  if (stateA < 0 || stateA >= (int) states.size() ||
+      stateB < 0 || stateB >= (int) states.size()) {
+    return -1;
+  }
+  if (findTransition(stateA, stateB, signal) >= 0) {
+    return -1;
+  }
+  frozen.reset();
+  State* st = states[stateA];
+  Transition* tr = transition_pool.create();
+  tr->label = transLabel;
+  tr->signal = signal;
+  tr->next_state = stateB;
+  tr->output = output;
+  int id = (int) transitions.size();
+  transitions.push_back(tr);
+  if (signal == FAILURE_SIGNAL) {
+    st->failure_trans = id;
+  } else {
+    // insert after any transitions with the same signal so the first
+    // one added keeps winning.
+    size_t n = st->signals.size();
+    size_t pos = lowerBound(st->signals.data(), n, signal);
+    while (pos < n && st->signals[pos] == signal) {
+      pos++;
+    }
+    st->trans.insert(st->trans.begin() + pos, id);
+    st->signals.insert(st->signals.begin() + pos, signal);
+    TransitionKey key = { stateA, signal, stateB };
+    transition_index[key] = id;
+  }
+  return id;
+}
+
+int FSM::findTransition(int stateA, int stateB, int signal) {
+  State* st = getState(stateA);
+  if (st == NULL) {
+    return -1;
+  }
+  if (signal == FAILURE_SIGNAL) {
+    if (st->failure_trans >= 0 &&
+	transitions[st->failure_trans]->next_state == stateB) {
+      return st->failure_trans;
+    }
+    return -1;
+  }
+  TransitionKey key = { stateA, signal, stateB };
+  unordered_map<TransitionKey, int, TransitionKeyHash>::iterator it =
+    transition_index.find(key);
+  if (it == transition_index.end()) {
+    return -1;
+  }
+  return it->second;
+}
+
+int FSM::matchTransition(int id, int signal) {
+  State* st = getState(id);
+  if (st == NULL) {
+    return -1;
+  }
+  size_t n = st->signals.size();
+  size_t pos = lowerBound(st->signals.data(), n, signal);
+  if (pos < n && st->signals[pos] == signal) {
+    return st->trans[pos];
+  }
+  return st->failure_trans;
 }
 
 int FSM::countStates() {
-  // TODO
-  return 0;
+  return (int) states.size();
 }
 
 int FSM::countTransitions() {
-  // TODO
-  return 0;
+  return (int) transitions.size();
 }
 
 int FSM::getCurrentState() {
-  // TODO
-  return 0;
+  return state;
 }
 
 bool FSM::isAcceptState() {
-  // TODO
-  return false;
+  State* st = getState(state);
+  if (st == NULL) {
+    return false;
+  }
+  return st->accept;
 }
 
 State* FSM::getState(int id) {
-  // TODO
-  return NULL;
+  if (id < 0 || id >= (int) states.size()) {
+    return NULL;
+  }
+  return states[id];
 }
 
 Transition* FSM::getTransition(int id) {
-  // TODO
-  return NULL;
+  if (id < 0 || id >= (int) transitions.size()) {
+    return NULL;
+  }
+  return transitions[id];
 }
 
 int FSM::getDefaultState() {
-  // TODO
-  return 0;
+  return default_state;
 }
 
 void FSM::setState(int id) {
-  // TODO  
+  state = id;
 }
 
 bool FSM::handleSignal(int signal) {
+  return step<false>(signal, NULL);
+}
+
+bool FSM::handleSignal(int signal, HitShard& hits) {
+  return step<true>(signal, &hits);
+}
+
+template <bool Counting>
+bool FSM::step(int signal, HitShard* hits) {
   // like addTransition, the documentation is longer than the
   // implementation. Here's my pseudocode:
   //
   // 1. If the FSM is currently in a bad state, return false.
   //
-  // 2. Iterate through the current state's normal transitions and
-  // look for one that has the same signal as the one given to the
-  // method.
+  // 2. Search the current state's normal transitions for one that has
+  // the same signal as the one given to the method. They are sorted
+  // by signal, so matchTransition can binary search them.
   //
   // 3. If there wasn't a normal transition, see if there was a
   // failure_trans transition for the state. If not, return false.
@@ -103,26 +253,982 @@ bool FSM::handleSignal(int signal) {
   // to be in the next_state indicated by that transition, and return
   // true.
 
-  // TODO
+  if (frozen && !Counting) {
+    if (state < 0 || state >= frozen->num_states) {
+      return false;
+    }
+    int next = frozen->nextState(state, signal);
+    if (next < 0) {
+      return false;
+    }
+    state = next;
+    return true;
+  }
+  int tr = matchTransition(state, signal);
+  if (Counting && state >= 0 && state < (int) states.size()) {
+    hits->countState(state);
+    if (tr < 0) {
+      hits->countMiss(state);
+    } else {
+      hits->countTransition(tr);
+      if (tr == states[state]->failure_trans) {
+	hits->countFailure(state);
+      }
+    }
+  }
+  if (tr < 0) {
+    return false;
+  }
+  state = transitions[tr]->next_state;
+  return true;
+}
+
+bool FSM::handleSignals(const int* begin, const int* end) {
+  if (frozen) {
+    state = frozen->run(state, begin, end);
+    return frozen->isAcceptState(state);
+  }
+  for (const int* p=begin; p != end; ++p) {
+    handleSignal(*p);
+  }
+  return isAcceptState();
+}
+
+bool FSM::handleSignals(string_view input) {
+  if (frozen) {
+    state = frozen->run(state, input);
+    return frozen->isAcceptState(state);
+  }
+  for (size_t i=0; i < input.size(); i++) {
+    handleSignal((int) input[i]);
+  }
+  return isAcceptState();
+}
+
+bool FSM::transduce(string_view input, uint64_t* value) {
+  int id = default_state;
+  if (id < 0) {
+    return false;
+  }
+  uint64_t sum = 0;
+  for (size_t i=0; i < input.size(); i++) {
+    int tr = matchTransition(id, (int) input[i]);
+    if (tr >= 0) {
+      sum += transitions[tr]->output;
+      id = transitions[tr]->next_state;
+    }
+  }
+  if (!states[id]->accept) {
+    return false;
+  }
+  *value = sum + states[id]->final_output;
+  return true;
+}
+
+CompiledFSM FSM::compile() {
+  CompiledFSM c;
+  c.num_states = (int) states.size();
+  c.default_state = default_state;
+  c.signals = signalClasses();
+  c.num_classes = c.signals.countClasses();
+  for (int i=0; i < 256; i++) {
+    c.char_class[i] = c.signals.classOf((int) (char) i);
+  }
+
+  c.accept_bits.assign((c.num_states + 63) / 64, 0);
+  c.next_state.assign((size_t) c.num_states * c.num_classes, -1);
+  for (int s=0; s < c.num_states; s++) {
+    State* st = states[s];
+    if (st->accept) {
+      c.accept_bits[s >> 6] |= (uint64_t) 1 << (s & 63);
+    }
+    int* row = &c.next_state[(size_t) s * c.num_classes];
+    // fill in reverse so the first matching transition wins, the same
+    // way handleSignal picks it, and then default the rest of the row
+    // (always including class 0) to the failure target.
+    for (size_t i=st->trans.size(); i > 0; i--) {
+      Transition* tr = transitions[st->trans[i-1]];
+      row[c.signals.classOf(tr->signal)] = tr->next_state;
+    }
+    if (st->failure_trans >= 0) {
+      int fail = transitions[st->failure_trans]->next_state;
+      for (int col=0; col < c.num_classes; col++) {
+	if (row[col] < 0) {
+	  row[col] = fail;
+	}
+      }
+    }
+  }
+  return c;
+}
+
+PackedFSM FSM::pack() {
+  PackedFSM p;
+  p.num_states = (int) states.size();
+  p.default_state = default_state;
+  p.accept_bits.assign((p.num_states + 63) / 64, 0);
+  p.failure_state.assign(p.num_states, -1);
+  p.labels.resize(p.num_states);
+  p.failure_ids.assign(p.num_states, -1);
+  p.transition_ids.reserve(transitions.size());
+  p.offsets.reserve(p.num_states + 1);
+  p.signals.reserve(transitions.size());
+  p.targets.reserve(transitions.size());
+
+  // only carry outputs if some transition or state has one.
+  bool has_outputs = false;
+  for (size_t i=0; i < transitions.size() && !has_outputs; i++) {
+    has_outputs = transitions[i]->output != 0;
+  }
+  for (size_t i=0; i < states.size() && !has_outputs; i++) {
+    has_outputs = states[i]->final_output != 0;
+  }
+  if (has_outputs) {
+    p.outputs.reserve(transitions.size());
+    p.failure_output.assign(p.num_states, 0);
+    p.final_output.assign(p.num_states, 0);
+  }
+
+  for (int s=0; s < p.num_states; s++) {
+    State* st = states[s];
+    if (st->accept) {
+      p.accept_bits[s >> 6] |= (uint64_t) 1 << (s & 63);
+    }
+    if (st->failure_trans >= 0) {
+      p.failure_state[s] = transitions[st->failure_trans]->next_state;
+      p.failure_ids[s] = st->failure_trans;
+      if (has_outputs) {
+	p.failure_output[s] = transitions[st->failure_trans]->output;
+      }
+    }
+    if (has_outputs) {
+      p.final_output[s] = st->final_output;
+    }
+    p.labels[s] = st->label;
+
+    // `trans` is already sorted by signal. Keep only the first
+    // transition for each signal since that is the one handleSignal
+    // takes.
+    for (size_t i=0; i < st->trans.size(); i++) {
+      if (i > 0 && st->signals[i] == st->signals[i-1]) {
+	continue;
+      }
+      p.signals.push_back(st->signals[i]);
+      p.targets.push_back(transitions[st->trans[i]]->next_state);
+      p.transition_ids.push_back(st->trans[i]);
+      if (has_outputs) {
+	p.outputs.push_back(transitions[st->trans[i]]->output);
+      }
+    }
+    p.offsets.push_back((int) p.signals.size());
+  }
+  return p;
+}
+
+FSM FSM::minimize(vector<int>* mapping) {
+  int n = (int) states.size();
+  if (mapping != NULL) {
+    mapping->assign(n, -1);
+  }
+  FSM out;
+  if (n == 0 || default_state < 0) {
+    return out;
+  }
+  CompiledFSM table = compile();
+  int k = table.num_classes;
+  const vector<int>& next = table.next_state;
+
+  // 1. find the states reachable from the default state and number
+  // them densely. A -1 in the table means the state stays put, which
+  // for refinement is the same as a transition to itself.
+  vector<int> order; // local id -> old id
+  vector<int> local(n, -1); // old id -> local id
+  order.push_back(default_state);
+  local[default_state] = 0;
+  for (size_t i=0; i < order.size(); i++) {
+    const int* row = &next[(size_t) order[i] * k];
+    for (int c=0; c < k; c++) {
+      if (row[c] >= 0 && local[row[c]] < 0) {
+	local[row[c]] = (int) order.size();
+	order.push_back(row[c]);
+      }
+    }
+  }
+  int m = (int) order.size();
+  vector<int> delta((size_t) m * k);
+  for (int s=0; s < m; s++) {
+    const int* row = &next[(size_t) order[s] * k];
+    for (int c=0; c < k; c++) {
+      delta[(size_t) s * k + c] = row[c] < 0 ? s : local[row[c]];
+    }
+  }
+
+  // 2. the initial partition groups states by accept flag and by the
+  // set of classes they have no transition for, since handleSignal
+  // returns false for exactly those.
+  vector<int> block_of(m);
+  int num_blocks = 0;
+  {
+    unordered_map<string, int> groups;
+    string key(k + 1, '\0');
+    for (int s=0; s < m; s++) {
+      key[0] = states[order[s]]->accept ? 1 : 0;
+      const int* row = &next[(size_t) order[s] * k];
+      for (int c=0; c < k; c++) {
+	key[c + 1] = row[c] < 0 ? 1 : 0;
+      }
+      unordered_map<string, int>::iterator it = groups.find(key);
+      if (it == groups.end()) {
+	it = groups.insert(make_pair(key, num_blocks++)).first;
+      }
+      block_of[s] = it->second;
+    }
+  }
+
+  // blocks are contiguous runs [first, last) of `elems`. While a
+  // splitter is processed, the marked members of a block are moved
+  // to the front of its run.
+  vector<int> elems(m);
+  vector<int> loc(m);
+  vector<int> first(num_blocks, 0);
+  vector<int> last(num_blocks, 0);
+  vector<int> marked(num_blocks, 0);
+  for (int s=0; s < m; s++) {
+    last[block_of[s]]++;
+  }
+  for (int b=1; b < num_blocks; b++) {
+    last[b] += last[b-1];
+  }
+  for (int b=0; b < num_blocks; b++) {
+    first[b] = last[b];
+  }
+  for (int s=m-1; s >= 0; s--) {
+    int pos = --first[block_of[s]];
+    elems[pos] = s;
+    loc[s] = pos;
+  }
+
+  // inverse transitions: the predecessors of state t on class c are
+  // inv[inv_start[t*k+c] .. inv_start[t*k+c+1]).
+  vector<int> inv_start((size_t) m * k + 1, 0);
+  for (size_t i=0; i < delta.size(); i++) {
+    inv_start[(size_t) delta[i] * k + i % k + 1]++;
+  }
+  for (size_t i=1; i < inv_start.size(); i++) {
+    inv_start[i] += inv_start[i-1];
+  }
+  vector<int> inv(delta.size());
+  {
+    vector<int> fill(inv_start.begin(), inv_start.end() - 1);
+    for (size_t i=0; i < delta.size(); i++) {
+      inv[fill[(size_t) delta[i] * k + i % k]++] = (int) (i / k);
+    }
+  }
+
+  // 3. Hopcroft's refinement. Every initial block starts out as a
+  // splitter; after that a split block only needs its smaller half
+  // queued, unless it was still waiting in the queue itself.
+  vector<int> work;
+  vector<char> in_work(num_blocks, 1);
+  for (int b=0; b < num_blocks; b++) {
+    work.push_back(b);
+  }
+  vector<int> splitter;
+  vector<int> touched;
+  while (!work.empty()) {
+    int a = work.back();
+    work.pop_back();
+    in_work[a] = 0;
+    splitter.assign(elems.begin() + first[a], elems.begin() + last[a]);
+    for (int c=0; c < k; c++) {
+      touched.clear();
+      for (size_t i=0; i < splitter.size(); i++) {
+	size_t t = (size_t) splitter[i] * k + c;
+	for (int j=inv_start[t]; j < inv_start[t+1]; j++) {
+	  int p = inv[j];
+	  int b = block_of[p];
+	  int front = first[b] + marked[b];
+	  if (loc[p] < front) {
+	    continue;
+	  }
+	  int other = elems[front];
+	  elems[loc[p]] = other;
+	  loc[other] = loc[p];
+	  elems[front] = p;
+	  loc[p] = front;
+	  if (marked[b]++ == 0) {
+	    touched.push_back(b);
+	  }
+	}
+      }
+      for (size_t i=0; i < touched.size(); i++) {
+	int b = touched[i];
+	if (marked[b] == last[b] - first[b]) {
+	  marked[b] = 0;
+	  continue;
+	}
+	int z = num_blocks++;
+	first.push_back(first[b]);
+	last.push_back(first[b] + marked[b]);
+	marked.push_back(0);
+	first[b] = last[z];
+	marked[b] = 0;
+	for (int j=first[z]; j < last[z]; j++) {
+	  block_of[elems[j]] = z;
+	}
+	if (in_work[b]) {
+	  work.push_back(z);
+	  in_work.push_back(1);
+	} else if (last[z] - first[z] <= last[b] - first[b]) {
+	  work.push_back(z);
+	  in_work.push_back(1);
+	} else {
+	  work.push_back(b);
+	  in_work[b] = 1;
+	  in_work.push_back(0);
+	}
+      }
+    }
+  }
+
+  // 4. number the blocks in breadth-first order from the default
+  // state's block, so the default state stays state 0, and pick the
+  // lowest old id in each block as its representative.
+  vector<int> rep(num_blocks, -1);
+  for (int s=0; s < m; s++) {
+    int b = block_of[s];
+    if (rep[b] < 0 || order[s] < order[rep[b]]) {
+      rep[b] = s;
+    }
+  }
+  vector<int> new_id(num_blocks, -1);
+  vector<int> block_order;
+  new_id[block_of[0]] = 0;
+  block_order.push_back(block_of[0]);
+  for (size_t i=0; i < block_order.size(); i++) {
+    const int* row = &delta[(size_t) rep[block_order[i]] * k];
+    for (int c=0; c < k; c++) {
+      int b = block_of[row[c]];
+      if (new_id[b] < 0) {
+	new_id[b] = (int) block_order.size();
+	block_order.push_back(b);
+      }
+    }
+  }
+
+  // 5. build the new FSM from the representatives.
+  out.reserve(num_blocks, 0);
+  for (size_t i=0; i < block_order.size(); i++) {
+    State* st = states[order[rep[block_order[i]]]];
+    out.addState(st->label, st->accept);
+  }
+  for (size_t i=0; i < block_order.size(); i++) {
+    State* st = states[order[rep[block_order[i]]]];
+    for (size_t j=0; j < st->trans.size(); j++) {
+      if (j > 0 && st->signals[j] == st->signals[j-1]) {
+	continue; // never taken
+      }
+      Transition* tr = transitions[st->trans[j]];
+      int target = new_id[block_of[local[tr->next_state]]];
+      out.addTransition((int) i, target, tr->signal, tr->label);
+    }
+    if (st->failure_trans >= 0) {
+      Transition* tr = transitions[st->failure_trans];
+      int target = new_id[block_of[local[tr->next_state]]];
+      out.addTransition((int) i, target, FAILURE_SIGNAL, tr->label);
+    }
+  }
+  if (mapping != NULL) {
+    for (int s=0; s < m; s++) {
+      (*mapping)[order[s]] = new_id[block_of[s]];
+    }
+  }
+  return out;
+}
+
+bool FSM::isDeterministic() {
+  for (size_t s=0; s < states.size(); s++) {
+    const vector<int>& sigs = states[s]->signals;
+    for (size_t i=1; i < sigs.size(); i++) {
+      if (sigs[i] == sigs[i-1]) {
+	return false;
+      }
+    }
+  }
+  return true;
+}
+
+void FSM::startSet(StateSet& set) {
+  set.resize((int) states.size());
+  set.add(default_state);
+}
+
+bool FSM::stepSet(const StateSet& from, int signal, StateSet& to) {
+  to.resize((int) states.size());
+  bool moved = false;
+  const vector<uint64_t>& words = from.bits;
+  for (size_t w=0; w < words.size(); w++) {
+    uint64_t word = words[w];
+    while (word != 0) {
+      int s = (int) (w * 64 + __builtin_ctzll(word));
+      word &= word - 1;
+      if (s >= (int) states.size()) {
+	break;
+      }
+      State* st = states[s];
+      size_t n = st->signals.size();
+      size_t i = lowerBound(st->signals.data(), n, signal);
+      if (i < n && st->signals[i] == signal) {
+	for (; i < n && st->signals[i] == signal; i++) {
+	  to.add(transitions[st->trans[i]]->next_state);
+	}
+	moved = true;
+      } else if (st->failure_trans >= 0) {
+	to.add(transitions[st->failure_trans]->next_state);
+	moved = true;
+      } else {
+	to.add(s);
+      }
+    }
+  }
+  return moved;
+}
+
+bool FSM::isAcceptSet(const StateSet& set) {
+  for (size_t s=0; s < states.size(); s++) {
+    if (states[s]->accept && set.contains((int) s)) {
+      return true;
+    }
+  }
   return false;
 }
 
+FSM FSM::determinize(vector<vector<int> >* subsets) {
+  FSM out;
+  if (subsets != NULL) {
+    subsets->clear();
+  }
+  if (states.empty() || default_state < 0) {
+    return out;
+  }
+  SignalMap m = signalClasses();
+  int k = m.countClasses();
+
+  // the signals in each class. Class 0 is everything else, which
+  // FAILURE_SIGNAL stands in for since no normal transition uses it.
+  vector<vector<int> > members(k);
+  for (size_t i=0; i < transitions.size(); i++) {
+    int sig = transitions[i]->signal;
+    if (sig != FAILURE_SIGNAL) {
+      members[m.classOf(sig)].push_back(sig);
+    }
+  }
+  for (int c=0; c < k; c++) {
+    sort(members[c].begin(), members[c].end());
+    members[c].erase(unique(members[c].begin(), members[c].end()),
+		     members[c].end());
+  }
+
+  // each new state is keyed by the raw bytes of its sorted members.
+  vector<StateSet> sets;
+  unordered_map<string, int> ids;
+  StateSet start;
+  startSet(start);
+
+  // intern returns the new state for a set, creating it if needed.
+  auto intern = [&](const StateSet& set) -> int {
+    vector<int> ms = set.members();
+    string key((const char*) ms.data(), ms.size() * sizeof(int));
+    unordered_map<string, int>::iterator it = ids.find(key);
+    if (it != ids.end()) {
+      return it->second;
+    }
+    string label = "{";
+    for (size_t i=0; i < ms.size(); i++) {
+      label += (i > 0 ? "," : "") + to_string(ms[i]);
+    }
+    label += "}";
+    int id = out.addState(label, isAcceptSet(set));
+    ids[key] = id;
+    sets.push_back(set);
+    return id;
+  };
+  intern(start);
+
+  vector<StateSet> targets(k);
+  vector<char> moved(k);
+  for (size_t d=0; d < sets.size(); d++) {
+    for (int c=0; c < k; c++) {
+      moved[c] = stepSet(sets[d], m.getRepresentative(c), targets[c]);
+    }
+    // class 0 becomes the failure transition. Any other class that
+    // lands in the same place can rely on it; a class where nothing
+    // moves can only occur when class 0 doesn't move either.
+    int fail = -1;
+    if (moved[0]) {
+      fail = intern(targets[0]);
+      out.addTransition((int) d, fail, FAILURE_SIGNAL, "fail");
+    }
+    for (int c=1; c < k; c++) {
+      if (!moved[c] || (moved[0] && targets[c] == targets[0])) {
+	continue;
+      }
+      int next = intern(targets[c]);
+      for (size_t i=0; i < members[c].size(); i++) {
+	out.addTransition((int) d, next, members[c][i], to_string(members[c][i]));
+      }
+    }
+  }
+  if (subsets != NULL) {
+    for (size_t d=0; d < sets.size(); d++) {
+      subsets->push_back(sets[d].members());
+    }
+  }
+  return out;
+}
+
+SignalMap FSM::signalClasses() {
+  SignalMap m;
+
+  // every signal used by a normal transition, sorted so each one has
+  // a dense index.
+  vector<int> sigs;
+  for (size_t i=0; i < transitions.size(); i++) {
+    if (transitions[i]->signal != FAILURE_SIGNAL) {
+      sigs.push_back(transitions[i]->signal);
+    }
+  }
+  sort(sigs.begin(), sigs.end());
+  sigs.erase(unique(sigs.begin(), sigs.end()), sigs.end());
+
+  // refine the partition one state at a time. Within a state, a
+  // signal moves out of its class into a class keyed by (old class,
+  // targets), where targets lists the next state of every transition
+  // on that signal in the order they were added. That keeps both the
+  // first-match choice of handleSignal and the full target set of
+  // stepSet the same across a class. A signal whose only transition
+  // goes to the state's fallback (the failure target, or nowhere)
+  // behaves like every signal the state ignores, so it stays put.
+  vector<int> cls(sigs.size(), 0);
+  int next_cls = 1;
+  unordered_map<string, int> split;
+  string key;
+  for (size_t s=0; s < states.size(); s++) {
+    State* st = states[s];
+    int fallback = -1;
+    if (st->failure_trans >= 0) {
+      fallback = transitions[st->failure_trans]->next_state;
+    }
+    split.clear();
+    size_t n = st->trans.size();
+    size_t i = 0;
+    while (i < n) {
+      size_t j = i + 1;
+      while (j < n && st->signals[j] == st->signals[i]) {
+	j++;
+      }
+      if (j - i == 1 && transitions[st->trans[i]]->next_state == fallback) {
+	i = j;
+	continue;
+      }
+      size_t idx = lower_bound(sigs.begin(), sigs.end(), st->signals[i]) - sigs.begin();
+      key.assign((const char*) &cls[idx], sizeof(int));
+      for (size_t q=i; q < j; q++) {
+	int target = transitions[st->trans[q]]->next_state;
+	key.append((const char*) &target, sizeof(int));
+      }
+      unordered_map<string, int>::iterator it = split.find(key);
+      if (it == split.end()) {
+	it = split.insert(make_pair(key, next_cls++)).first;
+      }
+      cls[idx] = it->second;
+      i = j;
+    }
+  }
+
+  // renumber the surviving classes densely, keeping class 0.
+  vector<int> renumber(next_cls, -1);
+  renumber[0] = 0;
+  m.num_classes = 1;
+  for (size_t i=0; i < sigs.size(); i++) {
+    if (renumber[cls[i]] < 0) {
+      renumber[cls[i]] = m.num_classes++;
+      m.representative.push_back(sigs[i]);
+    }
+    int c = renumber[cls[i]];
+    if ((unsigned) sigs[i] < 256) {
+      m.byte_class[sigs[i]] = c;
+    } else if (c != 0) {
+      m.sparse_signals.push_back(sigs[i]);
+      m.sparse_class.push_back(c);
+    }
+  }
+  return m;
+}
+
+void FSM::freeze() {
+  frozen = make_shared<const CompiledFSM>(compile());
+}
+
+bool FSM::isFrozen() {
+  return frozen != NULL;
+}
+
+shared_ptr<const CompiledFSM> FSM::share() {
+  if (!frozen) {
+    freeze();
+  }
+  return frozen;
+}
+
+StateSet::StateSet() {
+  num_states = 0;
+}
+
+StateSet::StateSet(int num_states) {
+  this->num_states = 0;
+  resize(num_states);
+}
+
+void StateSet::resize(int num_states) {
+  this->num_states = num_states < 0 ? 0 : num_states;
+  bits.assign((this->num_states + 63) / 64, 0);
+}
+
+void StateSet::clear() {
+  bits.assign(bits.size(), 0);
+}
+
+bool StateSet::isEmpty() const {
+  for (size_t i=0; i < bits.size(); i++) {
+    if (bits[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int StateSet::count() const {
+  int n = 0;
+  for (size_t i=0; i < bits.size(); i++) {
+    n += __builtin_popcountll(bits[i]);
+  }
+  return n;
+}
+
+vector<int> StateSet::members() const {
+  vector<int> ids;
+  for (size_t w=0; w < bits.size(); w++) {
+    uint64_t word = bits[w];
+    while (word != 0) {
+      ids.push_back((int) (w * 64 + __builtin_ctzll(word)));
+      word &= word - 1;
+    }
+  }
+  return ids;
+}
+
+int StateSet::capacity() const {
+  return num_states;
+}
+
+bool StateSet::operator == (const StateSet& other) const {
+  return num_states == other.num_states && bits == other.bits;
+}
+
+SignalMap::SignalMap() {
+  num_classes = 1;
+  for (int i=0; i < 256; i++) {
+    byte_class[i] = 0;
+  }
+  representative.push_back(FAILURE_SIGNAL);
+}
+
+int SignalMap::countClasses() const {
+  return num_classes;
+}
+
+int SignalMap::getRepresentative(int cls) const {
+  if (cls <= 0 || cls >= num_classes) {
+    return FAILURE_SIGNAL;
+  }
+  return representative[cls];
+}
+
+int SignalMap::sparseClassOf(int signal) const {
+  vector<int>::const_iterator it =
+    lower_bound(sparse_signals.begin(), sparse_signals.end(), signal);
+  if (it == sparse_signals.end() || *it != signal) {
+    return 0;
+  }
+  return sparse_class[it - sparse_signals.begin()];
+}
+
+CompiledFSM::CompiledFSM() {
+  num_states = 0;
+  num_classes = 1;
+  default_state = -1;
+  for (int i=0; i < 256; i++) {
+    char_class[i] = 0;
+  }
+}
+
+int CompiledFSM::countStates() const {
+  return num_states;
+}
+
+int CompiledFSM::countClasses() const {
+  return num_classes;
+}
+
+const SignalMap& CompiledFSM::getSignalMap() const {
+  return signals;
+}
+
+int CompiledFSM::getDefaultState() const {
+  return default_state;
+}
+
+int CompiledFSM::run(int id, const int* begin, const int* end) const {
+  if (id < 0 || id >= num_states) {
+    return id;
+  }
+  const int* table = next_state.data();
+  size_t k = num_classes;
+  for (const int* p=begin; p != end; ++p) {
+    int next = table[id * k + signals.classOf(*p)];
+    id = next < 0 ? id : next;
+  }
+  return id;
+}
+
+int CompiledFSM::run(int id, string_view input) const {
+  if (id < 0 || id >= num_states) {
+    return id;
+  }
+  const int* table = next_state.data();
+  size_t k = num_classes;
+  const unsigned char* p = (const unsigned char*) input.data();
+  const unsigned char* end = p + input.size();
+  for (; p != end; ++p) {
+    int next = table[id * k + char_class[*p]];
+    id = next < 0 ? id : next;
+  }
+  return id;
+}
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+	      "hit counters must be as cheap as plain integers");
+
+HitShard::HitShard(int num_states, int num_transitions) {
+  // each array starts on its own cache line, and the block is a whole
+  // number of cache lines.
+  size_t s = ((size_t) num_states + 7) & ~(size_t) 7;
+  size_t t = ((size_t) num_transitions + 7) & ~(size_t) 7;
+  block_size = 3 * s + t;
+  if (block_size == 0) {
+    block_size = 8;
+  }
+  block = (Counter*) ::operator new(block_size * sizeof(Counter), std::align_val_t(64));
+  for (size_t i=0; i < block_size; i++) {
+    new (block + i) Counter(0);
+  }
+  states = block;
+  failures = states + s;
+  misses = failures + s;
+  transitions = misses + s;
+}
+
+HitShard::~HitShard() {
+  ::operator delete(block, std::align_val_t(64));
+}
+
+HitCounters::HitCounters(int num_states, int num_transitions) {
+  static std::atomic<uint64_t> next_id(1);
+  this->num_states = num_states < 0 ? 0 : num_states;
+  this->num_transitions = num_transitions < 0 ? 0 : num_transitions;
+  id = next_id++;
+}
+
+HitCounters::~HitCounters() {
+  for (size_t i=0; i < shards.size(); i++) {
+    delete shards[i];
+  }
+}
+
+HitShard& HitCounters::local() {
+  // remember the last shard this thread used, so repeated calls don't
+  // take the lock. The id guards against a new HitCounters at the
+  // address of one that was destroyed.
+  thread_local uint64_t cached_id = 0;
+  thread_local HitShard* cached = NULL;
+  if (cached_id == id) {
+    return *cached;
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  std::thread::id me = std::this_thread::get_id();
+  HitShard* shard = NULL;
+  for (size_t i=0; i < shards.size() && shard == NULL; i++) {
+    if (shards[i]->owner == me) {
+      shard = shards[i];
+    }
+  }
+  if (shard == NULL) {
+    shard = new HitShard(num_states, num_transitions);
+    shard->owner = me;
+    shards.push_back(shard);
+  }
+  cached_id = id;
+  cached = shard;
+  return *shard;
+}
+
+uint64_t HitCounters::sum(HitShard::Counter* HitShard::*array, int index,
+			  int limit) const {
+  if (index < 0 || index >= limit) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  uint64_t total = 0;
+  for (size_t i=0; i < shards.size(); i++) {
+    total += (shards[i]->*array)[index].load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+uint64_t HitCounters::stateHits(int id) const {
+  return sum(&HitShard::states, id, num_states);
+}
+
+uint64_t HitCounters::transitionHits(int id) const {
+  return sum(&HitShard::transitions, id, num_transitions);
+}
+
+uint64_t HitCounters::failureHits(int state) const {
+  return sum(&HitShard::failures, state, num_states);
+}
+
+uint64_t HitCounters::missHits(int state) const {
+  return sum(&HitShard::misses, state, num_states);
+}
+
+void HitCounters::reset() {
+  std::lock_guard<std::mutex> guard(lock);
+  for (size_t i=0; i < shards.size(); i++) {
+    for (size_t j=0; j < shards[i]->block_size; j++) {
+      shards[i]->block[j].store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+CursorStats::CursorStats() {
+  signals = 0;
+  transitions = 0;
+  misses = 0;
+}
+
+Cursor::Cursor() {
+  state = -1;
+  stats = NULL;
+}
+
+PackedFSM::PackedFSM() {
+  num_states = 0;
+  default_state = -1;
+  offsets.push_back(0);
+}
+
+int PackedFSM::countStates() const {
+  return num_states;
+}
+
+int PackedFSM::countTransitions() const {
+  return (int) signals.size();
+}
+
+int PackedFSM::getDefaultState() const {
+  return default_state;
+}
+
+string PackedFSM::getLabel(int id) const {
+  if (id < 0 || id >= num_states) {
+    return "";
+  }
+  return labels[id];
+}
+
+int PackedFSM::run(int id, const int* begin, const int* end) const {
+  if (id < 0 || id >= num_states) {
+    return id;
+  }
+  for (const int* p=begin; p != end; ++p) {
+    int next = nextState(id, *p);
+    id = next < 0 ? id : next;
+  }
+  return id;
+}
+
+int PackedFSM::run(int id, string_view input) const {
+  if (id < 0 || id >= num_states) {
+    return id;
+  }
+  for (size_t i=0; i < input.size(); i++) {
+    int next = nextState(id, (int) input[i]);
+    id = next < 0 ? id : next;
+  }
+  return id;
+}
+
+bool PackedFSM::transduce(string_view input, uint64_t* value) const {
+  int id = default_state;
+  if (id < 0) {
+    return false;
+  }
+  if (outputs.empty() && final_output.empty()) {
+    id = run(id, input);
+    if (!isAcceptState(id)) {
+      return false;
+    }
+    *value = 0;
+    return true;
+  }
+  uint64_t sum = 0;
+  for (size_t i=0; i < input.size(); i++) {
+    int signal = (int) input[i];
+    const int* row = signals.data() + offsets[id];
+    size_t n = offsets[id + 1] - offsets[id];
+    size_t j = lowerBound(row, n, signal);
+    if (j < n && row[j] == signal) {
+      sum += outputs[offsets[id] + j];
+      id = targets[offsets[id] + j];
+    } else if (failure_state[id] >= 0) {
+      sum += failure_output[id];
+      id = failure_state[id];
+    }
+  }
+  if (!isAcceptState(id)) {
+    return false;
+  }
+  *value = sum + final_output[id];
+  return true;
+}
+
 ostream &operator << (ostream& out, FSM* fsm) {
   int c = 0;
   for (auto it=fsm->states.begin(); it != fsm->states.end(); ++it) {
-    out << "  state " << c << ": " << *it << endl;
+    out << "  state " << c << ": " << *it << '\n';
     c++;
   }
   c = 0;
   for (auto it=fsm->transitions.begin(); it != fsm->transitions.end(); ++it) {
-    out << "  trans " << c << ": " << *it << endl;
+    out << "  trans " << c << ": " << *it << '\n';
     c++;
   }
   out << "  current state: " << fsm->state;
   if (fsm->isAcceptState()) {
     out << " (accepting state!)";
   }
-  out << endl;
+  out << '\n';
   return out;
 }
 
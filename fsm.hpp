@@ -18,6 +18,14 @@
 #include <iostream>
 #include <vector>
 #include <iostream>
+#include <memory>
+#include <new>
+#include <unordered_map>
+#include <string_view>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <stdint.h>
 
 #define FAILURE_SIGNAL -1
 
@@ -26,6 +34,140 @@ using namespace std;
 // forward declarations
 class State;
 class Transition;
+class CompiledFSM;
+class PackedFSM;
+class SignalMap;
+class CursorStats;
+class StateSet;
+class MappedFSM;
+class HitShard;
+template <class Record> class TraceRing;
+
+// Pool hands out T objects carved from large contiguous blocks, so
+// objects created one after another sit next to each other in
+// memory and cost no allocation of their own. Objects live until the
+// pool is cleared or destroyed, which destroys them all at once.
+// Pointers stay valid until then.
+template <class T>
+class Pool {
+private:
+  struct Block {
+    T* items;    // raw storage for `capacity` objects
+    size_t used; // number of constructed objects at the front
+    size_t capacity;
+  };
+
+  vector<Block> blocks; // the last block is the one being filled
+
+public:
+
+  // Pool constructs an empty pool.
+  Pool() {}
+
+  // ~Pool destroys every object the pool handed out.
+  ~Pool() {
+    clear();
+  }
+
+  // reserve makes sure the next n objects fit in a single block.
+  void reserve(size_t n) {
+    if (!blocks.empty() &&
+	blocks.back().capacity - blocks.back().used >= n) {
+      return;
+    }
+    size_t cap = blocks.empty() ? 16 : blocks.back().capacity * 2;
+    if (cap < n) {
+      cap = n;
+    }
+    Block b;
+    b.items = static_cast<T*>(::operator new(cap * sizeof(T)));
+    b.used = 0;
+    b.capacity = cap;
+    blocks.push_back(b);
+  }
+
+  // create default-constructs a new object in the pool and returns it.
+  T* create() {
+    reserve(1);
+    Block& b = blocks.back();
+    T* item = new (b.items + b.used) T();
+    b.used++;
+    return item;
+  }
+
+  // create copies the given object into the pool and returns the copy.
+  T* create(const T& value) {
+    reserve(1);
+    Block& b = blocks.back();
+    T* item = new (b.items + b.used) T(value);
+    b.used++;
+    return item;
+  }
+
+  // clear destroys every object and releases all blocks.
+  void clear() {
+    for (size_t i=0; i < blocks.size(); i++) {
+      for (size_t j=0; j < blocks[i].used; j++) {
+	blocks[i].items[j].~T();
+      }
+      ::operator delete(blocks[i].items);
+    }
+    blocks.clear();
+  }
+
+  // swap exchanges the contents of two pools.
+  void swap(Pool& other) {
+    blocks.swap(other.blocks);
+  }
+
+private:
+  Pool(const Pool&);
+  Pool& operator=(const Pool&);
+};
+
+// lowerBound returns the index of the first of the n sorted values
+// that is not less than `value`, or n if there is none. The loop has
+// a fixed trip count for a given n and no data-dependent branches,
+// so the compiler can turn the comparison into a conditional move.
+inline size_t lowerBound(const int* first, size_t n, int value) {
+  if (n == 0) {
+    return 0;
+  }
+  const int* base = first;
+  while (n > 1) {
+    size_t half = n / 2;
+    base += (base[half - 1] < value) ? half : 0;
+    n -= half;
+  }
+  return (base - first) + (*base < value);
+}
+
+// TransitionKey identifies a normal transition by the states it
+// connects and the signal it reacts to, which is exactly what makes a
+// transition a duplicate.
+class TransitionKey {
+public:
+  int from;   // stateA
+  int signal; // the signal
+  int to;     // stateB
+
+  bool operator == (const TransitionKey& other) const {
+    return from == other.from && signal == other.signal && to == other.to;
+  }
+};
+
+// TransitionKeyHash mixes all three fields of a TransitionKey.
+class TransitionKeyHash {
+public:
+  size_t operator () (const TransitionKey& k) const {
+    uint64_t h = (uint64_t) (uint32_t) k.from << 32 | (uint32_t) k.signal;
+    h ^= (uint64_t) (uint32_t) k.to * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+    return (size_t) h;
+  }
+};
 
 class FSM {
 private:
@@ -34,18 +176,53 @@ private:
 
   vector<Transition*> transitions; // A transition's index is its ID
 
+  Pool<State> state_pool; // owns every State in `states`
+
+  Pool<Transition> transition_pool; // owns every Transition in
+				    // `transitions`
+
+  unordered_map<TransitionKey, int, TransitionKeyHash> transition_index;
+  // maps every normal transition's key to its ID. Failure
+  // transitions are not indexed; there is only one per state.
+
   int state; // the current state of the FSM. Default should be -1
 
   int default_state; // default state of the FSM. Default should be
 		     // -1. This can be used to reset the FSM with
 		     // setState(getCurrentState()).
 
+  shared_ptr<const CompiledFSM> frozen; // table used by handleSignal
+					 // after freeze(). NULL while
+					 // the FSM is being edited.
+
 public:
 
   // FSM constructs a finite state machine with default
   // values. Initialize some variables as described above.
   FSM();
 
+  // FSM constructs a deep copy of another FSM. The copy has its own
+  // states and transitions, with the same IDs as the original.
+  FSM(const FSM& other);
+
+  // FSM takes over the states and transitions of another FSM, which
+  // is left empty.
+  FSM(FSM&& other);
+
+  // operator = replaces this FSM's contents with a copy of (or, for
+  // temporaries, the contents of) another FSM.
+  FSM& operator = (FSM other);
+
+  // ~FSM frees every state and transition at once.
+  ~FSM();
+
+  // swap exchanges the contents of two FSMs.
+  void swap(FSM& other);
+
+  // reserve prepares the FSM for the given number of additional
+  // states and transitions, so adding them needs no further
+  // allocation beyond their labels and `trans` lists.
+  void reserve(int num_states, int num_transitions);
 
   // addState creates a new State. The new state:
   //   -- has the given label
@@ -103,6 +280,27 @@ public:
   int addTransition(int stateA, int stateB, 
 		    int signal, string transLabel);
 
+  // addTransition adds a transition that also carries an output
+  // value for transduce. See the other addTransition function for the
+  // rest of the documentation.
+  int addTransition(int stateA, int stateB, 
+		    int signal, string transLabel, uint64_t output);
+
+  // findTransition returns the ID of the normal transition from
+  // stateA to stateB on the given signal, or -1 if there is none. For
+  // FAILURE_SIGNAL it returns stateA's failure transition if that one
+  // leads to stateB. This takes constant time however many
+  // transitions stateA has.
+  int findTransition(int stateA, int stateB, int signal);
+
+  // matchTransition returns the ID of the transition handleSignal
+  // would take from the given state on the given signal: the first
+  // normal transition for that signal, or else the state's failure
+  // transition. It returns -1 if there is neither, or if the state is
+  // not in the FSM. Lookups binary search the state's sorted `trans`
+  // list, so they take logarithmic time in the state's fanout.
+  int matchTransition(int id, int signal);
+
   // countState returns the number of states this FSM has.
   int countStates();
 
@@ -143,8 +341,128 @@ public:
   // If no transition was taken this returns false.
   bool handleSignal(int signal);
 
+  // handleSignal behaves like the other handleSignal, and also counts
+  // the signal in `hits`: the current state's hit, the transition
+  // taken, and whether it was the failure transition or no transition
+  // at all. It always walks the `trans` lists, even when frozen, so
+  // that it knows which transition was taken. The shard must belong
+  // to a HitCounters sized for this FSM.
+  bool handleSignal(int signal, HitShard& hits);
+
+  // handleSignal behaves like the other handleSignal and, for the
+  // signals the trace samples, records the step and the transition
+  // taken. Defined in fsm_trace.hpp.
+  template <class Record>
+  bool handleSignal(int signal, TraceRing<Record>& trace);
+
+  // handleSignals feeds every signal in [begin, end) to the FSM in
+  // order, exactly as if handleSignal had been called on each one,
+  // and leaves the FSM in the final state. It returns true if that
+  // final state is an accept state. A frozen FSM runs the whole
+  // buffer in one tight loop over the compiled table.
+  bool handleSignals(const int* begin, const int* end);
+
+  // handleSignals feeds each character of the input to the FSM, using
+  // (int) c as the signal the same way a loop over handleSignal
+  // would. See the other handleSignals function for the rest.
+  bool handleSignals(string_view input);
+
+  // transduce runs the FSM as a transducer: starting from the default
+  // state it feeds each character of the input, using (int) c as the
+  // signal like handleSignals, and adds up the output of every
+  // transition taken plus the final_output of the state it ends
+  // in. It returns true and stores the sum in `value` if that state
+  // accepts, and returns false otherwise. The FSM's current state is
+  // not changed.
+  bool transduce(string_view input, uint64_t* value);
+
+  // isDeterministic returns true if no state has two normal
+  // transitions on the same signal. handleSignal only ever takes the
+  // first of those; stepSet and determinize follow all of them.
+  bool isDeterministic();
+
+  // startSet sets `set` to hold just the default state, sized for
+  // this FSM's states. It is empty if the FSM has no states.
+  void startSet(StateSet& set);
+
+  // stepSet runs the FSM as a nondeterministic machine: every state in
+  // `from` follows all of its normal transitions for the signal, or
+  // its failure transition if it has none, or stays where it is if it
+  // has neither. `to` receives the union of the states reached. This
+  // returns true if any state took a transition. With a
+  // deterministic FSM this is the same as handleSignal on each state
+  // of the set.
+  bool stepSet(const StateSet& from, int signal, StateSet& to);
+
+  // isAcceptSet returns true if any state in the set accepts.
+  bool isAcceptSet(const StateSet& set);
+
+  // determinize runs the subset construction and returns a
+  // deterministic FSM that behaves like stepSet started from
+  // startSet: each of its states stands for a set of this FSM's
+  // states, it accepts if any of those do, and handleSignal returns
+  // true when stepSet would. State 0 is the default state's set.
+  //
+  // If `subsets` is not NULL, entry N is filled with the sorted ids of
+  // the states that the new state N stands for.
+  FSM determinize(vector<vector<int> >* subsets);
+
+  // compile builds a CompiledFSM from the current states and
+  // transitions. The FSM itself is not modified, and later edits to
+  // the FSM are not reflected in the returned table.
+  CompiledFSM compile();
+
+  // pack builds a PackedFSM from the current states and transitions.
+  // Like compile, the result is a snapshot that later edits to the
+  // FSM do not affect.
+  PackedFSM pack();
+
+  // minimize returns a new FSM with the fewest states that behaves
+  // exactly like this one when started from the default state: every
+  // input leads to an accept state in one if and only if it does in
+  // the other, and handleSignal returns the same values along the
+  // way. States that can't be reached from the default state are
+  // dropped, and equivalent states are merged using Hopcroft's
+  // partition refinement over signal classes. Each merged state keeps
+  // the label and transitions of the lowest state ID it replaces.
+  //
+  // Transition and final outputs are not taken into account and are
+  // not carried over, so transducers should not be minimized this
+  // way.
+  //
+  // If `mapping` is not NULL, it is filled with the new ID of every
+  // old state, or -1 for the states that were dropped.
+  FSM minimize(vector<int>* mapping);
+
+  // signalClasses partitions every possible signal into classes of
+  // signals that all states treat identically. Only signals used by
+  // normal transitions are ever separated from class 0.
+  SignalMap signalClasses();
+
+  // freeze compiles the FSM and makes handleSignal use the compiled
+  // table instead of walking the `trans` lists. Any later call to
+  // addState or addTransition discards the table again, so a frozen
+  // FSM always behaves exactly like an unfrozen one.
+  void freeze();
+
+  // isFrozen returns true if handleSignal is currently using a
+  // compiled table.
+  bool isFrozen();
+
+  // share returns the FSM's compiled table, freezing the FSM first if
+  // it isn't already. The table never changes once built (later
+  // edits to the FSM build a new one), so it can be handed to any
+  // number of Cursors on any number of threads.
+  shared_ptr<const CompiledFSM> share();
+
   // for user-friendly debugging output
   friend ostream &operator << (ostream& out, FSM* fsm);
+
+private:
+  // step is handleSignal, with the hit counting compiled in only when
+  // Counting is true.
+  template <bool Counting>
+  bool step(int signal, HitShard* hits);
 }; // end class FSM
 
 class State {
@@ -158,7 +476,16 @@ public:
 		     // but don't have any matching transitions in the
 		     // 'trans' vector for the input signal.
 
-  vector<int> trans; // normal transition ids are stored here.
+  vector<int> trans; // normal transition ids are stored here,
+		     // sorted by signal. Transitions with the same
+		     // signal stay in the order they were added.
+
+  vector<int> signals; // signals[i] is the signal of trans[i], so
+		       // lookups can binary search without touching
+		       // the Transition objects.
+
+  uint64_t final_output; // added to the result of FSM::transduce when
+			 // the input ends in this state. 0 by default.
 
   // operator << is used to send a State reference to an output
   // stream.
@@ -170,8 +497,571 @@ public:
   string label;   // label for this transition. a debugging var.
   int signal;     // signal this transition reacts to
   int next_state; // id of the state we transition to when activated
+  uint64_t output; // added to the result of FSM::transduce when this
+		   // transition is taken. 0 by default.
   friend ostream &operator << (ostream& out, Transition* trans);
 
 };
 
+// StateSet is a set of state ids kept as a bitset, used to run an
+// FSM as a nondeterministic machine.
+class StateSet {
+private:
+  vector<uint64_t> bits;
+
+  int num_states;
+
+public:
+
+  // StateSet constructs an empty set with room for no states.
+  StateSet();
+
+  // StateSet constructs an empty set with room for states 0 to
+  // num_states - 1.
+  explicit StateSet(int num_states);
+
+  // resize empties the set and makes room for num_states states.
+  void resize(int num_states);
+
+  // clear empties the set.
+  void clear();
+
+  // add puts the state in the set. Out of range ids are ignored.
+  void add(int id) {
+    if (id >= 0 && id < num_states) {
+      bits[id >> 6] |= (uint64_t) 1 << (id & 63);
+    }
+  }
+
+  // contains returns true if the state is in the set.
+  bool contains(int id) const {
+    if (id < 0 || id >= num_states) {
+      return false;
+    }
+    return (bits[id >> 6] >> (id & 63)) & 1;
+  }
+
+  // isEmpty returns true if the set has no states.
+  bool isEmpty() const;
+
+  // count returns the number of states in the set.
+  int count() const;
+
+  // members returns the ids in the set in ascending order.
+  vector<int> members() const;
+
+  // capacity returns the number of state ids the set has room for.
+  int capacity() const;
+
+  bool operator == (const StateSet& other) const;
+
+  friend class FSM;
+};
+
+// HitShard is one thread's set of hit counters, handed out by
+// HitCounters::local. Each kind of counter is an array indexed by
+// state or transition ID, and the whole shard sits in its own
+// cache-line aligned block, so threads counting into their own shards
+// never share a cache line.
+class HitShard {
+private:
+  typedef std::atomic<uint64_t> Counter;
+
+  Counter* block; // every array below, in one allocation
+  size_t block_size; // number of counters in `block`
+
+  Counter* states;      // signals handled in each state
+  Counter* transitions; // times each transition was taken
+  Counter* failures;    // times each state took its failure
+			// transition
+  Counter* misses;      // signals each state had no transition for
+
+  std::thread::id owner; // the thread counting into this shard
+
+  friend class HitCounters;
+
+  HitShard(const HitShard&);
+  HitShard& operator=(const HitShard&);
+
+  // bump adds one to a counter. Only the owner writes a shard, so a
+  // relaxed load and store is enough, and unlike an atomic increment
+  // it costs no more than a plain one. Readers on other threads still
+  // see a whole value.
+  static void bump(Counter& c) {
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+public:
+
+  // HitShard constructs zeroed counters for the given numbers of
+  // states and transitions.
+  HitShard(int num_states, int num_transitions);
+
+  // ~HitShard frees the counters.
+  ~HitShard();
+
+  // countState, countTransition, countFailure and countMiss add one
+  // hit. The ids must be in range.
+  void countState(int id) {
+    bump(states[id]);
+  }
+
+  void countTransition(int id) {
+    bump(transitions[id]);
+  }
+
+  void countFailure(int state) {
+    bump(failures[state]);
+  }
+
+  void countMiss(int state) {
+    bump(misses[state]);
+  }
+};
+
+// HitCounters counts how often each state, transition and failure
+// transition of a machine is used, for finding hot transitions and
+// unexpected input. Counting happens in per-thread shards, so threads
+// never contend, and the getters add all shards up when asked.
+// Nothing is counted unless a counting overload (FSM::handleSignal
+// or Cursor::handleSignal with a HitShard) is called; the ordinary
+// overloads have no counting code in them at all.
+//
+// A thread should call local() once and pass the shard to every
+// counting call it makes. The counters are relaxed atomics with a
+// single writer each, so the getters may run while other threads
+// count; they give totals that may be slightly behind.
+class HitCounters {
+private:
+  int num_states;
+  int num_transitions;
+
+  uint64_t id; // tells apart counters that reuse an address
+
+  mutable std::mutex lock; // guards `shards`
+  vector<HitShard*> shards;
+
+  HitCounters(const HitCounters&);
+  HitCounters& operator=(const HitCounters&);
+
+  // sum adds up one counter array across all shards.
+  uint64_t sum(HitShard::Counter* HitShard::*array, int index, int limit) const;
+
+public:
+
+  // HitCounters constructs zeroed counters for a machine with the
+  // given numbers of states and transitions.
+  HitCounters(int num_states, int num_transitions);
+
+  // ~HitCounters frees every shard.
+  ~HitCounters();
+
+  // local returns the calling thread's shard, creating it on first
+  // use.
+  HitShard& local();
+
+  // stateHits returns the number of signals handled in the state.
+  uint64_t stateHits(int id) const;
+
+  // transitionHits returns the number of times the transition was
+  // taken, including failure transitions.
+  uint64_t transitionHits(int id) const;
+
+  // failureHits returns the number of times the state took its
+  // failure transition.
+  uint64_t failureHits(int state) const;
+
+  // missHits returns the number of signals the state had no normal or
+  // failure transition for.
+  uint64_t missHits(int state) const;
+
+  // reset zeroes every counter in every shard. It must not run while
+  // other threads are counting.
+  void reset();
+};
+
+// SignalMap partitions the signal space into equivalence classes:
+// two signals share a class if every state of the FSM has the same
+// transitions, in the same order, for both of them. Class 0 holds
+// every signal that no state reacts to with a normal transition, so
+// it stands for "take the failure transition". Signals 0-255 are
+// looked up directly, and all other signals through a sorted side
+// table.
+class SignalMap {
+private:
+  int num_classes;
+
+  int byte_class[256]; // class of each signal in [0, 256)
+
+  vector<int> sparse_signals; // sorted signals outside [0, 256)
+
+  vector<int> sparse_class; // class of each entry in sparse_signals
+
+  vector<int> representative; // one signal in each class. Class 0's
+			      // entry is FAILURE_SIGNAL.
+
+  friend class FSM;
+  friend class MappedFSM;
+
+public:
+
+  // SignalMap constructs a map with a single class holding every
+  // signal.
+  SignalMap();
+
+  // countClasses returns the number of classes, including class 0.
+  int countClasses() const;
+
+  // getRepresentative returns a signal that belongs to the given
+  // class, or FAILURE_SIGNAL for class 0 and unknown classes.
+  int getRepresentative(int cls) const;
+
+  // classOf returns the class the given signal belongs to.
+  int classOf(int signal) const {
+    if ((unsigned) signal < 256) {
+      return byte_class[signal];
+    }
+    return sparseClassOf(signal);
+  }
+
+private:
+  int sparseClassOf(int signal) const;
+};
+
+// CompiledFSM is an immutable, table-driven form of an FSM built by
+// FSM::compile(). Each state owns one row of `next_state`, with one
+// column per signal class. A column holds the id of the state the
+// class leads to, which is the failure transition's target when the
+// state has no matching normal transition, or -1 if neither exists.
+// Column 0 is the row default used by signals no state mentions.
+class CompiledFSM {
+private:
+  int num_states;
+
+  SignalMap signals; // maps a signal to its column
+
+  int num_classes; // number of columns in each row
+
+  vector<int> next_state; // num_states * num_classes next-state ids
+
+  vector<uint64_t> accept_bits; // bit N is set if state N accepts
+
+  int default_state; // copied from the FSM. -1 if it had no states.
+
+  int char_class[256]; // column for each byte of a char input,
+		       // indexed by (unsigned char) c
+
+  friend class FSM;
+  friend class MappedFSM;
+
+public:
+
+  // CompiledFSM constructs an empty table with no states.
+  CompiledFSM();
+
+  // countStates returns the number of states in the table.
+  int countStates() const;
+
+  // countClasses returns the number of signal classes, which is the
+  // number of columns in each row.
+  int countClasses() const;
+
+  // getSignalMap returns the signal classes the table is indexed by.
+  const SignalMap& getSignalMap() const;
+
+  // getDefaultState returns the default state's ID, or -1 if the
+  // table has no states.
+  int getDefaultState() const;
+
+  // isAcceptState returns true if the given state is an accepting
+  // state. Out of range ids return false.
+  bool isAcceptState(int id) const {
+    if (id < 0 || id >= num_states) {
+      return false;
+    }
+    return (accept_bits[id >> 6] >> (id & 63)) & 1;
+  }
+
+  // nextState returns the state reached from the given state on the
+  // given signal, or -1 if the FSM would not take any transition.
+  // This is the same decision FSM::handleSignal makes. The state id
+  // must be valid.
+  int nextState(int id, int signal) const {
+    return next_state[(size_t) id * num_classes + signals.classOf(signal)];
+  }
+
+  // run feeds every signal in [begin, end) to the table starting in
+  // the given state and returns the state it ends in. Signals with no
+  // transition leave the state unchanged, as in FSM::handleSignal. An
+  // invalid start state is returned as is.
+  int run(int id, const int* begin, const int* end) const;
+
+  // run feeds each character of the input to the table, using (int) c
+  // as the signal. See the other run function for the rest.
+  int run(int id, string_view input) const;
+};
+
+// PackedFSM is an immutable struct-of-arrays form of an FSM built by
+// FSM::pack(). The fields handleSignal needs are kept in parallel
+// arrays indexed by state id, and each state's normal transitions are
+// a sorted slice of the compressed-sparse-row arrays `signals` and
+// `targets`. Unlike CompiledFSM its size grows with the number of
+// transitions rather than states times signal classes, which suits
+// very large, sparse machines. Labels live in a separate array that
+// the run path never touches.
+class PackedFSM {
+private:
+  int num_states;
+
+  int default_state; // copied from the FSM. -1 if it had no states.
+
+  vector<uint64_t> accept_bits; // bit N is set if state N accepts
+
+  vector<int> failure_state; // per-state failure target, or -1
+
+  vector<int> offsets; // state N's transitions are the entries
+		       // [offsets[N], offsets[N+1]) of the arrays below
+
+  vector<int> signals; // transition signals, ascending within a state
+
+  vector<int> targets; // transition next states
+
+  vector<uint64_t> outputs; // transition outputs, parallel to
+			    // `targets`. Empty if the FSM had no
+			    // outputs, in which case all are 0.
+
+  vector<uint64_t> failure_output; // per-state failure transition
+				   // output. Empty like `outputs`.
+
+  vector<uint64_t> final_output; // per-state final output. Empty like
+				 // `outputs`.
+
+  vector<string> labels; // state labels. Only used to debug.
+
+  vector<int> transition_ids; // the FSM transition ID of each entry
+			      // in `targets`. Only used to count and
+			      // trace.
+
+  vector<int> failure_ids; // per-state failure transition ID, or -1.
+			   // Only used to count and trace.
+
+  friend class FSM;
+
+public:
+
+  // PackedFSM constructs an empty machine with no states.
+  PackedFSM();
+
+  // countStates returns the number of states.
+  int countStates() const;
+
+  // countTransitions returns the number of normal transitions kept,
+  // after dropping any that handleSignal could never take.
+  int countTransitions() const;
+
+  // getDefaultState returns the default state's ID, or -1 if there
+  // are no states.
+  int getDefaultState() const;
+
+  // getLabel returns the label of the given state, or an empty string
+  // for out of range ids.
+  string getLabel(int id) const;
+
+  // isAcceptState returns true if the given state is an accepting
+  // state. Out of range ids return false.
+  bool isAcceptState(int id) const {
+    if (id < 0 || id >= num_states) {
+      return false;
+    }
+    return (accept_bits[id >> 6] >> (id & 63)) & 1;
+  }
+
+  // nextState returns the state reached from the given state on the
+  // given signal, or -1 if the FSM would not take any transition.
+  // The state id must be valid.
+  int nextState(int id, int signal) const {
+    const int* row = signals.data() + offsets[id];
+    size_t n = offsets[id + 1] - offsets[id];
+    size_t i = lowerBound(row, n, signal);
+    if (i < n && row[i] == signal) {
+      return targets[offsets[id] + i];
+    }
+    return failure_state[id];
+  }
+
+  // nextState behaves like the other nextState and also counts the
+  // step in `hits`, using the IDs of the FSM the machine was packed
+  // from.
+  int nextState(int id, int signal, HitShard& hits) const {
+    hits.countState(id);
+    const int* row = signals.data() + offsets[id];
+    size_t n = offsets[id + 1] - offsets[id];
+    size_t i = lowerBound(row, n, signal);
+    if (i < n && row[i] == signal) {
+      hits.countTransition(transition_ids[offsets[id] + i]);
+      return targets[offsets[id] + i];
+    }
+    if (failure_state[id] >= 0) {
+      hits.countFailure(id);
+      hits.countTransition(failure_ids[id]);
+      return failure_state[id];
+    }
+    hits.countMiss(id);
+    return -1;
+  }
+
+  // matchTransition returns the ID, in the FSM the machine was packed
+  // from, of the transition nextState would take, or -1 if there is
+  // none. The state id must be valid.
+  int matchTransition(int id, int signal) const {
+    const int* row = signals.data() + offsets[id];
+    size_t n = offsets[id + 1] - offsets[id];
+    size_t i = lowerBound(row, n, signal);
+    if (i < n && row[i] == signal) {
+      return transition_ids[offsets[id] + i];
+    }
+    return failure_ids[id];
+  }
+
+  // run feeds every signal in [begin, end) to the machine starting in
+  // the given state and returns the state it ends in. Signals with no
+  // transition leave the state unchanged. An invalid start state is
+  // returned as is.
+  int run(int id, const int* begin, const int* end) const;
+
+  // run feeds each character of the input to the machine, using
+  // (int) c as the signal. See the other run function for the rest.
+  int run(int id, string_view input) const;
+
+  // transduce behaves like FSM::transduce on the FSM the machine was
+  // packed from.
+  bool transduce(string_view input, uint64_t* value) const;
+};
+
+// CursorStats collects counts from any Cursor pointed at it. A stats
+// object is not synchronized, so cursors on different threads need
+// their own.
+class CursorStats {
+public:
+  uint64_t signals;     // signals handled
+  uint64_t transitions; // signals that led to a transition
+  uint64_t misses;      // signals with no normal or failure transition
+
+  // CursorStats constructs zeroed counters.
+  CursorStats();
+};
+
+// Cursor is the per-session half of a running machine: it holds only
+// the current state, while the graph lives in an immutable machine
+// (a CompiledFSM or a PackedFSM) that many cursors share. Every call
+// takes the machine to run against, which must be the same one the
+// cursor was reset with.
+class Cursor {
+public:
+  int state; // the cursor's current state. -1 if it has none.
+
+  CursorStats* stats; // optional counters. NULL to skip counting.
+
+  // Cursor constructs a cursor with no current state.
+  Cursor();
+
+  // Cursor constructs a cursor in the machine's default state that
+  // reports to the given stats object, if any.
+  template <class Machine>
+  explicit Cursor(const Machine& machine, CursorStats* stats = NULL) {
+    state = machine.getDefaultState();
+    this->stats = stats;
+  }
+
+  // reset puts the cursor back in the machine's default state.
+  template <class Machine>
+  void reset(const Machine& machine) {
+    state = machine.getDefaultState();
+  }
+
+  // isAcceptState returns true if the cursor's current state is an
+  // accept state of the machine.
+  template <class Machine>
+  bool isAcceptState(const Machine& machine) const {
+    return machine.isAcceptState(state);
+  }
+
+  // handleSignal behaves like FSM::handleSignal: if the current state
+  // has a normal or failure transition for the signal, the cursor
+  // moves along it and this returns true. Otherwise this returns
+  // false and the cursor stays where it is.
+  template <class Machine>
+  bool handleSignal(const Machine& machine, int signal) {
+    if (state < 0 || state >= machine.countStates()) {
+      return false;
+    }
+    int next = machine.nextState(state, signal);
+    if (stats != NULL) {
+      stats->signals++;
+      if (next < 0) {
+	stats->misses++;
+      } else {
+	stats->transitions++;
+      }
+    }
+    if (next < 0) {
+      return false;
+    }
+    state = next;
+    return true;
+  }
+
+  // handleSignal behaves like the other handleSignal and also counts
+  // the step in `hits`. The machine has to support counting, which
+  // PackedFSM does.
+  template <class Machine>
+  bool handleSignal(const Machine& machine, int signal, HitShard& hits) {
+    if (state < 0 || state >= machine.countStates()) {
+      return false;
+    }
+    int next = machine.nextState(state, signal, hits);
+    if (next < 0) {
+      return false;
+    }
+    state = next;
+    return true;
+  }
+
+  // handleSignal behaves like the other handleSignal and, for the
+  // signals the trace samples, records the step. The records carry
+  // FSM transition IDs for machines that keep them, which PackedFSM
+  // does, and -1 for the others. Defined in fsm_trace.hpp.
+  template <class Machine, class Record>
+  bool handleSignal(const Machine& machine, int signal, TraceRing<Record>& trace);
+
+  // handleSignals feeds every signal in [begin, end) to the cursor and
+  // returns true if it ends in an accept state.
+  template <class Machine>
+  bool handleSignals(const Machine& machine, const int* begin, const int* end) {
+    if (stats != NULL) {
+      for (const int* p=begin; p != end; ++p) {
+	handleSignal(machine, *p);
+      }
+    } else {
+      state = machine.run(state, begin, end);
+    }
+    return machine.isAcceptState(state);
+  }
+
+  // handleSignals feeds each character of the input to the cursor,
+  // using (int) c as the signal, and returns true if it ends in an
+  // accept state.
+  template <class Machine>
+  bool handleSignals(const Machine& machine, string_view input) {
+    if (stats != NULL) {
+      for (size_t i=0; i < input.size(); i++) {
+	handleSignal(machine, (int) input[i]);
+      }
+    } else {
+      state = machine.run(state, input);
+    }
+    return machine.isAcceptState(state);
+  }
+};
+
 #endif
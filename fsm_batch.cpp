@@ -0,0 +1,99 @@
+//
+// fsm_batch.cpp
+//
+
+#include "fsm_batch.hpp"
+
+using namespace std;
+
+BatchRecognizer::BatchRecognizer(int threads) {
+  if (threads <= 0) {
+    threads = (int) thread::hardware_concurrency();
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  shares = vector<WorkerShare>(threads);
+  for (int i=0; i < threads; i++) {
+    shares[i].next = 0;
+    shares[i].end = 0;
+  }
+  job = NULL;
+  generation = 0;
+  pending = 0;
+  stopping = false;
+  for (int i=1; i < threads; i++) {
+    workers.push_back(thread(&BatchRecognizer::work, this, i));
+  }
+}
+
+BatchRecognizer::~BatchRecognizer() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (size_t i=0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+}
+
+int BatchRecognizer::countThreads() const {
+  return (int) shares.size();
+}
+
+void BatchRecognizer::work(int id) {
+  uint64_t seen = 0;
+  for (;;) {
+    {
+      unique_lock<mutex> guard(lock);
+      wake.wait(guard, [&]() { return stopping || generation != seen; });
+      if (stopping) {
+	return;
+      }
+      seen = generation;
+    }
+    drain(id);
+    lock_guard<mutex> guard(lock);
+    if (--pending == 0) {
+      done.notify_one();
+    }
+  }
+}
+
+void BatchRecognizer::drain(int id) {
+  size_t n = shares.size();
+  for (size_t k=0; k < n; k++) {
+    WorkerShare& share = shares[(id + k) % n];
+    for (;;) {
+      size_t b = share.next.fetch_add(1, std::memory_order_relaxed);
+      if (b >= share.end) {
+	break;
+      }
+      (*job)(b);
+    }
+  }
+}
+
+void BatchRecognizer::runBatches(const function<void(size_t)>& batch,
+				 size_t num_batches) {
+  if (num_batches == 0) {
+    return;
+  }
+  size_t n = shares.size();
+  {
+    lock_guard<mutex> guard(lock);
+    for (size_t i=0; i < n; i++) {
+      shares[i].next = num_batches * i / n;
+      shares[i].end = num_batches * (i + 1) / n;
+    }
+    job = &batch;
+    pending = (int) workers.size();
+    generation++;
+  }
+  wake.notify_all();
+  drain(0);
+  unique_lock<mutex> guard(lock);
+  done.wait(guard, [&]() { return pending == 0; });
+  job = NULL;
+}
@@ -0,0 +1,133 @@
+//
+// fsm_batch.hpp
+//
+// Recognizing many independent inputs against one machine on a pool
+// of threads.
+//
+
+#ifndef __fsm_batch_h__
+#define __fsm_batch_h__
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "fsm.hpp"
+
+using namespace std;
+
+// BatchRecognizer runs a machine over many short inputs at once, like
+// a list of tokens or URLs, and records which ones it accepts. It
+// keeps a pool of threads alive between calls, and the thread that
+// calls recognizeAll works alongside them.
+//
+// The inputs are cut into batches of batch_size, which is a multiple
+// of 64 so that no two batches write to the same word of the result
+// bitset. Each thread starts with an equal share of the batches and
+// claims them one at a time; once its own share is used up it steals
+// unclaimed batches from the other threads' shares, so a thread that
+// got the long inputs doesn't hold everyone up. Claiming a batch is a
+// single atomic increment. Each thread runs its batches with its own
+// Cursor on the shared machine, and nothing is allocated per input.
+//
+// A BatchRecognizer runs one recognizeAll at a time.
+class BatchRecognizer {
+public:
+  // batch_size is the number of inputs a thread claims at once.
+  static constexpr size_t batch_size = 1024;
+
+private:
+  // WorkerShare is one thread's share of the batches. Other threads
+  // claim from it once their own is used up.
+  struct alignas(64) WorkerShare {
+    std::atomic<size_t> next; // next batch to claim
+    size_t end;               // one past the share's last batch
+  };
+
+  vector<thread> workers; // the pool, not counting the caller
+
+  vector<WorkerShare> shares; // one per thread, the caller's first
+
+  const function<void(size_t)>* job; // runs one batch
+
+  mutex lock; // guards the fields below
+
+  condition_variable wake; // a new job or shutdown
+
+  condition_variable done; // the last worker finished a job
+
+  uint64_t generation; // counts jobs, so workers notice new ones
+
+  int pending; // workers still running the current job
+
+  bool stopping; // true once the destructor has started
+
+  // work is the loop each pool thread runs.
+  void work(int id);
+
+  // drain claims and runs batches, first from share `id` and then
+  // from the others, until none are left.
+  void drain(int id);
+
+  // runBatches runs batch(b) for every b in [0, num_batches) on the
+  // whole pool and returns when all are done.
+  void runBatches(const function<void(size_t)>& batch, size_t num_batches);
+
+  BatchRecognizer(const BatchRecognizer&);
+  BatchRecognizer& operator=(const BatchRecognizer&);
+
+public:
+
+  // BatchRecognizer constructs a recognizer that uses `threads`
+  // threads in all, including the caller's, or one per core if
+  // `threads` is 0.
+  explicit BatchRecognizer(int threads = 0);
+
+  // ~BatchRecognizer stops the pool.
+  ~BatchRecognizer();
+
+  // countThreads returns the number of threads that run batches,
+  // including the caller's.
+  int countThreads() const;
+
+  // recognizeAll runs the machine over each of the `count` inputs
+  // from its default state, as Cursor::handleSignals does, and sets
+  // bit i of `accepted` (bit i % 64 of word i / 64) if input i ends in
+  // an accept state. `accepted` is resized to (count + 63) / 64 words,
+  // so reusing it between calls of the same size allocates nothing.
+  // The machine is only read, so any machine form works.
+  template <class Machine>
+  void recognizeAll(const Machine& machine, const string_view* inputs,
+		    size_t count, vector<uint64_t>& accepted) {
+    accepted.resize((count + 63) / 64);
+    uint64_t* words = accepted.data();
+    function<void(size_t)> job = [&machine, inputs, count, words](size_t b) {
+      size_t begin = b * batch_size;
+      size_t end = begin + batch_size < count ? begin + batch_size : count;
+      Cursor cursor(machine);
+      uint64_t word = 0;
+      for (size_t i=begin; i < end; i++) {
+	cursor.reset(machine);
+	word |= (uint64_t) cursor.handleSignals(machine, inputs[i]) << (i & 63);
+	if ((i & 63) == 63 || i + 1 == end) {
+	  words[i >> 6] = word;
+	  word = 0;
+	}
+      }
+    };
+    runBatches(job, (count + batch_size - 1) / batch_size);
+  }
+
+  // recognizeAll runs the machine over every input in the vector. See
+  // the other recognizeAll.
+  template <class Machine>
+  void recognizeAll(const Machine& machine, const vector<string_view>& inputs,
+		    vector<uint64_t>& accepted) {
+    recognizeAll(machine, inputs.data(), inputs.size(), accepted);
+  }
+};
+
+#endif
@@ -0,0 +1,591 @@
+//
+// fsm_bench.cpp
+//
+// Benchmarks for the FSM hot paths. Build and run with `make bench`.
+//
+// Results go to stdout as one JSON document, and progress goes to
+// stderr. Every result has the time per operation and, where signals
+// are involved, signals per second and TSC cycles per signal (x86
+// only; the TSC ticks at a fixed rate, so this is reference cycles).
+// peak_rss_kb is the process's peak resident set size once the
+// benchmark finished, so it only grows from one result to the next.
+//
+// Options:
+//   --max-states N   largest random machine to build (default 10M,
+//                    which needs about 5 GB of memory)
+//   --quick          smaller inputs, for a fast smoke run
+//
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include <sys/resource.h>
+#include "fsm.hpp"
+#include "fsm_batch.hpp"
+#include "fsm_dict.hpp"
+#include "fsm_jit.hpp"
+#include "fsm_regex.hpp"
+#include "fsm_scan.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#endif
+
+using namespace std;
+
+// Result is one line of the report.
+class Result {
+public:
+  string group;           // which benchmark
+  string name;            // what was measured
+  vector<pair<string, double> > params; // sizes and settings
+  double ns_per_op;       // wall time per operation
+  string op;              // what an operation is
+  double signals;         // signals handled, or 0
+  double bytes;           // input bytes handled, or 0
+  double seconds;         // total time
+  double cycles;          // TSC cycles, or -1 if unavailable
+  long peak_rss_kb;       // peak RSS after the run
+};
+
+vector<Result> results;
+
+// Timer measures wall time and, where available, TSC cycles.
+class Timer {
+public:
+  chrono::steady_clock::time_point start;
+  uint64_t start_tsc;
+
+  Timer() {
+    start_tsc = 0;
+#ifdef BENCH_HAVE_TSC
+    start_tsc = __rdtsc();
+#endif
+    start = chrono::steady_clock::now();
+  }
+
+  double seconds() const {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  }
+
+  double cycles() const {
+#ifdef BENCH_HAVE_TSC
+    return (double) (__rdtsc() - start_tsc);
+#else
+    return -1;
+#endif
+  }
+};
+
+// peak_rss_kb returns the peak resident set size of the process.
+long peak_rss_kb() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  return ru.ru_maxrss / 1024;
+#else
+  return ru.ru_maxrss;
+#endif
+}
+
+// sink keeps results the compiler would otherwise throw away.
+volatile long sink;
+
+// record adds a result for `ops` operations timed by `t`, and reports
+// it on stderr.
+void record(const string& group, const string& name,
+	    const vector<pair<string, double> >& params,
+	    const Timer& t, double ops, const string& op,
+	    double signals, double bytes) {
+  Result r;
+  r.seconds = t.seconds();
+  r.cycles = t.cycles();
+  r.group = group;
+  r.name = name;
+  r.params = params;
+  r.ns_per_op = ops > 0 ? r.seconds * 1e9 / ops : 0;
+  r.op = op;
+  r.signals = signals;
+  r.bytes = bytes;
+  r.peak_rss_kb = peak_rss_kb();
+  results.push_back(r);
+  cerr << "  " << group << "/" << name;
+  for (size_t i=0; i < params.size(); i++) {
+    cerr << " " << params[i].first << "=" << (long long) params[i].second;
+  }
+  cerr << ": " << r.ns_per_op << " ns/" << op << "\n";
+}
+
+// json_string quotes a string for JSON. Names here are plain ASCII
+// apart from regex patterns, which only need \ and " escaped.
+string json_string(const string& s) {
+  string out = "\"";
+  for (size_t i=0; i < s.size(); i++) {
+    if (s[i] == '"' || s[i] == '\\') {
+      out += '\\';
+    }
+    out += s[i];
+  }
+  return out + "\"";
+}
+
+// print_json writes every result to stdout.
+void print_json() {
+  string out = "{\n  \"tsc_cycles\": ";
+#ifdef BENCH_HAVE_TSC
+  out += "true";
+#else
+  out += "false";
+#endif
+  out += ",\n  \"results\": [\n";
+  for (size_t i=0; i < results.size(); i++) {
+    const Result& r = results[i];
+    out += "    {\"group\": " + json_string(r.group) +
+      ", \"name\": " + json_string(r.name) + ", \"params\": {";
+    for (size_t j=0; j < r.params.size(); j++) {
+      out += (j > 0 ? ", " : "") + json_string(r.params[j].first) + ": " +
+	to_string((long long) r.params[j].second);
+    }
+    out += "}, \"op\": " + json_string(r.op) +
+      ", \"ns_per_op\": " + to_string(r.ns_per_op) +
+      ", \"seconds\": " + to_string(r.seconds);
+    if (r.signals > 0) {
+      out += ", \"signals_per_sec\": " + to_string(r.signals / r.seconds);
+      if (r.cycles >= 0) {
+	out += ", \"cycles_per_signal\": " + to_string(r.cycles / r.signals);
+      }
+    }
+    if (r.bytes > 0) {
+      out += ", \"mb_per_sec\": " + to_string(r.bytes / r.seconds / 1e6);
+    }
+    out += ", \"peak_rss_kb\": " + to_string(r.peak_rss_kb) + "}";
+    out += i + 1 < results.size() ? ",\n" : "\n";
+  }
+  out += "  ]\n}\n";
+  fwrite(out.data(), 1, out.size(), stdout);
+}
+
+// Rng is a small LCG so every run builds the same machines.
+class Rng {
+public:
+  uint64_t x;
+
+  explicit Rng(uint64_t seed) {
+    x = seed * 0x9e3779b97f4a7c15ULL + 1;
+  }
+
+  uint32_t next(uint32_t n) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32_t) ((x >> 32) % n);
+  }
+};
+
+// random_fsm builds a machine with `fanout` transitions per state
+// over the given number of signals, plus a failure transition on
+// every other state.
+FSM random_fsm(int num_states, int num_signals, int fanout, uint64_t seed) {
+  Rng rng(seed);
+  FSM fsm;
+  fsm.reserve(num_states, num_states * (fanout + 1));
+  for (int i=0; i < num_states; i++) {
+    fsm.addState("", rng.next(2) == 1);
+  }
+  for (int i=0; i < num_states; i++) {
+    for (int j=0; j < fanout; j++) {
+      fsm.addTransition(i, rng.next(num_states), rng.next(num_signals), "");
+    }
+    if (i % 2 == 0) {
+      fsm.addTransition(i, rng.next(num_states), FAILURE_SIGNAL, "");
+    }
+  }
+  return fsm;
+}
+
+// random_input returns `n` signals, as chars, in [0, num_signals).
+string random_input(size_t n, int num_signals, uint64_t seed) {
+  Rng rng(seed);
+  string s(n, '\0');
+  for (size_t i=0; i < n; i++) {
+    s[i] = (char) rng.next(num_signals);
+  }
+  return s;
+}
+
+// bench_build times addState and addTransition.
+void bench_build(int num_states, int fanout) {
+  vector<pair<string, double> > params = { { "states", num_states }, { "fanout", fanout } };
+  Rng rng(1);
+  Timer t;
+  FSM fsm;
+  for (int i=0; i < num_states; i++) {
+    fsm.addState("s", rng.next(2) == 1);
+  }
+  for (int i=0; i < num_states; i++) {
+    for (int j=0; j < fanout; j++) {
+      fsm.addTransition(i, rng.next(num_states), rng.next(64), "t");
+    }
+  }
+  sink = fsm.countTransitions();
+  record("build", "add", params, t, (double) num_states * (1 + fanout), "add", 0, 0);
+}
+
+// bench_fanout times one signal at a time through every machine form
+// over a 1000 state machine with the given fanout.
+void bench_fanout(int fanout, size_t n) {
+  const int num_signals = fanout < 64 ? 64 : fanout;
+  FSM fsm = random_fsm(1000, num_signals, fanout, fanout);
+  string input = random_input(n, num_signals, 7);
+  vector<int> signals(input.begin(), input.end());
+  vector<pair<string, double> > params = { { "states", 1000 }, { "fanout", fanout } };
+
+  fsm.setState(0);
+  Timer t;
+  for (size_t i=0; i < n; i++) {
+    fsm.handleSignal(signals[i]);
+  }
+  sink = fsm.getCurrentState();
+  record("handle_signal", "fsm", params, t, (double) n, "signal", (double) n, 0);
+
+  fsm.freeze();
+  fsm.setState(0);
+  t = Timer();
+  for (size_t i=0; i < n; i++) {
+    fsm.handleSignal(signals[i]);
+  }
+  sink = fsm.getCurrentState();
+  record("handle_signal", "fsm_frozen", params, t, (double) n, "signal", (double) n, 0);
+
+  CompiledFSM compiled = fsm.compile();
+  Cursor cur(compiled);
+  t = Timer();
+  for (size_t i=0; i < n; i++) {
+    cur.handleSignal(compiled, signals[i]);
+  }
+  sink = cur.state;
+  record("handle_signal", "cursor_compiled", params, t, (double) n, "signal", (double) n, 0);
+
+  PackedFSM packed = fsm.pack();
+  cur.reset(packed);
+  t = Timer();
+  for (size_t i=0; i < n; i++) {
+    cur.handleSignal(packed, signals[i]);
+  }
+  sink = cur.state;
+  record("handle_signal", "cursor_packed", params, t, (double) n, "signal", (double) n, 0);
+
+  t = Timer();
+  sink = compiled.run(0, input);
+  record("handle_signal", "run_compiled", params, t, (double) n, "signal", (double) n, (double) n);
+
+  t = Timer();
+  sink = packed.run(0, input);
+  record("handle_signal", "run_packed", params, t, (double) n, "signal", (double) n, (double) n);
+
+  JitFSM jit;
+  if (jit.compile(fsm)) {
+    t = Timer();
+    sink = jit.run(0, input);
+    record("handle_signal", "run_jit", params, t, (double) n, "signal", (double) n, (double) n);
+  }
+}
+
+// bench_recognize times the loop the unit tests' recognize helper
+// uses: reset to the default state, then handleSignal every char,
+// then check for acceptance, over a dictionary machine.
+void bench_recognize(int num_words, int num_lookups) {
+  Rng rng(3);
+  vector<string> words;
+  for (int i=0; i < num_words; i++) {
+    string w;
+    int len = 3 + rng.next(10);
+    for (int j=0; j < len; j++) {
+      w += (char) ('a' + rng.next(26));
+    }
+    words.push_back(w);
+  }
+  sort(words.begin(), words.end());
+  DictionaryBuilder builder;
+  for (size_t i=0; i < words.size(); i++) {
+    builder.addWord(words[i]);
+  }
+  FSM& fsm = builder.finish();
+
+  // half of the lookups are dictionary words.
+  vector<string> lookups;
+  size_t signals = 0;
+  for (int i=0; i < num_lookups; i++) {
+    string w = words[rng.next(num_words)];
+    if (i % 2 == 1) {
+      w[rng.next(w.size())] = 'A';
+    }
+    signals += w.size();
+    lookups.push_back(w);
+  }
+  vector<pair<string, double> > params = { { "words", num_words },
+					   { "states", fsm.countStates() } };
+
+  for (int frozen=0; frozen < 2; frozen++) {
+    if (frozen) {
+      fsm.freeze();
+    }
+    Timer t;
+    long found = 0;
+    for (size_t i=0; i < lookups.size(); i++) {
+      fsm.setState(fsm.getDefaultState());
+      const string& w = lookups[i];
+      for (size_t j=0; j < w.size(); j++) {
+	fsm.handleSignal((int) w[j]);
+      }
+      found += fsm.isAcceptState();
+    }
+    sink = found;
+    record("recognize", frozen ? "fsm_frozen" : "fsm", params, t,
+	   (double) lookups.size(), "string", (double) signals, (double) signals);
+  }
+
+  CompiledFSM compiled = fsm.compile();
+  Timer t;
+  long found = 0;
+  for (size_t i=0; i < lookups.size(); i++) {
+    found += compiled.isAcceptState(compiled.run(compiled.getDefaultState(), lookups[i]));
+  }
+  sink = found;
+  record("recognize", "run_compiled", params, t, (double) lookups.size(),
+	 "string", (double) signals, (double) signals);
+
+  vector<string_view> views(lookups.begin(), lookups.end());
+  BatchRecognizer batch;
+  vector<uint64_t> accepted;
+  vector<pair<string, double> > batch_params = params;
+  batch_params.push_back(make_pair("threads", (double) batch.countThreads()));
+  t = Timer();
+  batch.recognizeAll(compiled, views, accepted);
+  record("recognize", "batch_compiled", batch_params, t, (double) lookups.size(),
+	 "string", (double) signals, (double) signals);
+}
+
+// bench_scale builds a random machine of the given size over 16
+// signals and times building, compiling and running it. Runs jump
+// around the whole machine, so large ones measure cache misses.
+void bench_scale(int num_states, size_t n) {
+  vector<pair<string, double> > params = { { "states", num_states }, { "fanout", 2 } };
+  Timer t;
+  FSM fsm = random_fsm(num_states, 16, 2, 5);
+  record("scale", "build", params, t, (double) num_states, "state", 0, 0);
+
+  string input = random_input(n, 16, 9);
+  fsm.setState(0);
+  t = Timer();
+  for (size_t i=0; i < n; i++) {
+    fsm.handleSignal((int) input[i]);
+  }
+  sink = fsm.getCurrentState();
+  record("scale", "handle_signal", params, t, (double) n, "signal", (double) n, 0);
+
+  t = Timer();
+  PackedFSM packed = fsm.pack();
+  record("scale", "pack", params, t, (double) num_states, "state", 0, 0);
+  t = Timer();
+  sink = packed.run(0, input);
+  record("scale", "run_packed", params, t, (double) n, "signal", (double) n, (double) n);
+  packed = PackedFSM();
+
+  t = Timer();
+  CompiledFSM compiled = fsm.compile();
+  record("scale", "compile", params, t, (double) num_states, "state", 0, 0);
+  t = Timer();
+  sink = compiled.run(0, input);
+  record("scale", "run_compiled", params, t, (double) n, "signal", (double) n, (double) n);
+}
+
+// make_log builds `count` synthetic log lines. The same count always
+// gives the same lines.
+vector<string> make_log(int count) {
+  const char* levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+  const char* methods[] = { "GET", "GET", "POST", "PUT", "DELETE" };
+  const char* users[] = { "alice", "bob", "carol", "dave", "eve", "mallory" };
+  const char* notes[] = { "ok", "ok", "ok", "slow", "connection reset by peer",
+			  "upstream timeout", "cache miss" };
+  vector<string> lines;
+  uint64_t x = 12345;
+  for (int i=0; i < count; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    int status = (x >> 60) < 2 ? 500 + (int) ((x >> 20) % 4) : 200 + (int) ((x >> 24) % 5);
+    string line = "2024-03-" + to_string(10 + (x >> 8) % 20) + " 12:" +
+      to_string(10 + (x >> 14) % 50) + ":" + to_string(10 + (x >> 30) % 50) + " " +
+      levels[(x >> 33) % 6] + " " + methods[(x >> 37) % 5] + " /api/v" +
+      to_string(1 + (x >> 41) % 3) + "/items/" + to_string((x >> 44) % 100000) +
+      " user=" + users[(x >> 50) % 6] + " status=" + to_string(status) +
+      " note=\"" + notes[(x >> 53) % 7] + "\"";
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+// bench_regex times Regex::search against std::regex_search over the
+// same lines and checks that both find the same number of matches.
+bool bench_regex(const vector<string>& lines, const string& pattern) {
+  size_t bytes = 0;
+  for (size_t i=0; i < lines.size(); i++) {
+    bytes += lines[i].size() + 1;
+  }
+
+  Regex re;
+  if (!re.compile(pattern)) {
+    cerr << pattern << ": " << re.getError() << "\n";
+    return false;
+  }
+  vector<pair<string, double> > params = { { "lines", (double) lines.size() },
+					   { "states", re.getFSM().countStates() } };
+  Timer t;
+  size_t fsm_matches = 0;
+  for (size_t i=0; i < lines.size(); i++) {
+    fsm_matches += re.search(lines[i]);
+  }
+  record("regex", "fsm " + pattern, params, t, (double) lines.size(), "line",
+	 (double) bytes, (double) bytes);
+
+  std::regex std_re(pattern);
+  t = Timer();
+  size_t std_matches = 0;
+  for (size_t i=0; i < lines.size(); i++) {
+    std_matches += regex_search(lines[i], std_re);
+  }
+  record("regex", "std " + pattern, params, t, (double) lines.size(), "line",
+	 0, (double) bytes);
+  if (fsm_matches != std_matches) {
+    cerr << "  MISMATCH on " << pattern << ": fsm found " << fsm_matches
+	 << ", std::regex found " << std_matches << "\n";
+    return false;
+  }
+  return true;
+}
+
+// bench_scan times Scanner over the log lines joined into one text,
+// from memory on one thread and on every core, and from a file,
+// against a plain CompiledFSM::run that reports nothing.
+bool bench_scan(const vector<string>& lines) {
+  string text;
+  for (size_t i=0; i < lines.size(); i++) {
+    text += lines[i];
+    text += '\n';
+  }
+  AhoCorasick ac;
+  ac.addKeyword("ERROR");
+  ac.addKeyword("timeout");
+  ac.addKeyword("status=50");
+  ac.addKeyword("mallory");
+  ac.build();
+  const CompiledFSM& machine = ac.getMachine();
+  vector<pair<string, double> > params = { { "bytes", (double) text.size() },
+					   { "states", machine.countStates() } };
+  double bytes = (double) text.size();
+
+  Timer t;
+  sink = machine.run(machine.getDefaultState(), text);
+  record("scan", "run_compiled", params, t, bytes, "byte", bytes, bytes);
+
+  Scanner scanner;
+  scanner.load(machine);
+  t = Timer();
+  long matches = 0;
+  scanner.scan(text, [&](uint64_t, int) { matches++; });
+  record("scan", "memory", params, t, bytes, "byte", bytes, bytes);
+
+  vector<uint64_t> found;
+  scanner.reset();
+  t = Timer();
+  scanner.scanParallel(text, found);
+  vector<pair<string, double> > parallel_params = params;
+  parallel_params.push_back(make_pair("threads", (double) thread::hardware_concurrency()));
+  record("scan", "parallel", parallel_params, t, bytes, "byte", bytes, bytes);
+  if ((long) found.size() != matches) {
+    cerr << "  MISMATCH: sequential found " << matches << ", parallel found "
+	 << found.size() << "\n";
+    return false;
+  }
+
+  const char* path = "fsm_bench_scan.tmp";
+  FILE* f = fopen(path, "wb");
+  bool ok = f != NULL && fwrite(text.data(), 1, text.size(), f) == text.size();
+  ok = f != NULL && fclose(f) == 0 && ok;
+  long file_matches = 0;
+  scanner.reset();
+  t = Timer();
+  ok = ok && scanner.scanFile(path, [&](uint64_t, int) { file_matches++; });
+  record("scan", "file", params, t, bytes, "byte", bytes, bytes);
+  remove(path);
+  if (!ok || matches != file_matches) {
+    cerr << "  MISMATCH: memory found " << matches << ", file found "
+	 << file_matches << " " << scanner.getError() << "\n";
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  long max_states = 10000000;
+  bool quick = false;
+  for (int i=1; i < argc; i++) {
+    if (strcmp(argv[i], "--max-states") == 0 && i + 1 < argc) {
+      max_states = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--quick") == 0) {
+      quick = true;
+    } else {
+      cerr << "usage: " << argv[0] << " [--max-states N] [--quick]\n";
+      return 2;
+    }
+  }
+  if (quick && max_states > 100000) {
+    max_states = 100000;
+  }
+  size_t n = quick ? 1000000 : 20000000;
+
+  cerr << "build\n";
+  int build_fanouts[] = { 1, 4, 16 };
+  for (size_t i=0; i < sizeof(build_fanouts) / sizeof(build_fanouts[0]); i++) {
+    bench_build(quick ? 10000 : 200000, build_fanouts[i]);
+  }
+
+  cerr << "handle_signal\n";
+  int fanouts[] = { 1, 2, 4, 16, 64, 256 };
+  for (size_t i=0; i < sizeof(fanouts) / sizeof(fanouts[0]); i++) {
+    bench_fanout(fanouts[i], n);
+  }
+
+  cerr << "recognize\n";
+  bench_recognize(quick ? 10000 : 100000, quick ? 100000 : 2000000);
+
+  cerr << "scale\n";
+  for (long s=10; s <= max_states; s *= 10) {
+    bench_scale((int) s, n);
+  }
+
+  cerr << "regex\n";
+  vector<string> lines = make_log(quick ? 20000 : 200000);
+  const char* patterns[] = {
+    "ERROR",
+    "status=5\\d\\d",
+    "(GET|POST) /api/v[12]/",
+    "timeout|refused|reset",
+    "user=(alice|mallory) .*status=50[0-3]",
+    "^2024-03-1\\d 12:[0-5]\\d",
+    "\"(ok|slow)\"$",
+  };
+  bool ok = true;
+  for (size_t i=0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+    ok = bench_regex(lines, patterns[i]) && ok;
+  }
+
+  cerr << "scan\n";
+  ok = bench_scan(lines) && ok;
+
+  print_json();
+  return ok ? 0 : 1;
+}
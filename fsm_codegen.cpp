@@ -0,0 +1,139 @@
+//
+// fsm_codegen.cpp
+//
+
+#include "fsm_codegen.hpp"
+
+using namespace std;
+
+namespace {
+
+// commentSafe returns the label with anything that could end or
+// extend a // comment replaced.
+string commentSafe(const string& label) {
+  string out = label;
+  for (size_t i=0; i < out.size(); i++) {
+    unsigned char c = out[i];
+    if (c < 0x20 || c >= 0x7f || c == '\\') {
+      out[i] = '?';
+    }
+  }
+  return out;
+}
+
+// Row is the decision handleSignal makes in one state: the first
+// transition for each signal, and the failure target.
+class Row {
+public:
+  vector<pair<int, int> > cases; // (signal, next state), ascending
+  int failure;                   // failure target, or -1
+};
+
+Row rowOf(FSM& fsm, int id) {
+  Row row;
+  State* st = fsm.getState(id);
+  for (size_t i=0; i < st->trans.size(); i++) {
+    if (i > 0 && st->signals[i] == st->signals[i-1]) {
+      continue; // never taken
+    }
+    Transition* tr = fsm.getTransition(st->trans[i]);
+    row.cases.push_back(make_pair(tr->signal, tr->next_state));
+  }
+  row.failure = -1;
+  if (st->failure_trans >= 0) {
+    row.failure = fsm.getTransition(st->failure_trans)->next_state;
+  }
+  return row;
+}
+
+} // namespace
+
+string generateCpp(FSM& fsm, const string& prefix) {
+  int n = fsm.countStates();
+  vector<Row> rows;
+  rows.reserve(n);
+  for (int s=0; s < n; s++) {
+    rows.push_back(rowOf(fsm, s));
+  }
+
+  string out;
+  out += "// Generated by generateCpp from an FSM with " + to_string(n) +
+    " states. Do not edit.\n\n";
+  out += "#include <stddef.h>\n\n";
+  out += "extern \"C\" {\n\n";
+
+  out += "int " + prefix + "_start() {\n";
+  out += "  return " + to_string(fsm.getDefaultState()) + ";\n";
+  out += "}\n\n";
+
+  out += "int " + prefix + "_accepts(int state) {\n";
+  if (n > 0) {
+    out += "  static const unsigned char accept[" + to_string(n) + "] = {";
+    for (int s=0; s < n; s++) {
+      out += (s % 32 == 0) ? "\n    " : "";
+      out += fsm.getState(s)->accept ? "1," : "0,";
+    }
+    out += "\n  };\n";
+    out += "  return state >= 0 && state < " + to_string(n) +
+      " ? accept[state] : 0;\n";
+  } else {
+    out += "  (void) state;\n  return 0;\n";
+  }
+  out += "}\n\n";
+
+  // _next: one switch per state, failure as the default.
+  out += "int " + prefix + "_next(int state, int signal) {\n";
+  out += "  switch (state) {\n";
+  for (int s=0; s < n; s++) {
+    out += "  case " + to_string(s) + ": // " +
+      commentSafe(fsm.getState(s)->label) + "\n";
+    out += "    switch (signal) {\n";
+    for (size_t i=0; i < rows[s].cases.size(); i++) {
+      if (rows[s].cases[i].second == rows[s].failure) {
+	continue; // same as the default
+      }
+      out += "    case " + to_string(rows[s].cases[i].first) + ": return " +
+	to_string(rows[s].cases[i].second) + ";\n";
+    }
+    out += "    default: return " + to_string(rows[s].failure) + ";\n";
+    out += "    }\n";
+  }
+  out += "  default:\n    (void) signal;\n    return -1;\n";
+  out += "  }\n";
+  out += "}\n\n";
+
+  // _run: one labelled block per state that jumps straight to the
+  // next state's block. Signals a char can't produce are left out,
+  // and a state with no way out stays where it is. In both functions
+  // cases that lead where the default does are dropped.
+  out += "int " + prefix + "_run(int state, const char* data, size_t size) {\n";
+  out += "  const char* p = data;\n";
+  out += "  const char* end = data + size;\n";
+  out += "  switch (state) {\n";
+  for (int s=0; s < n; s++) {
+    out += "  case " + to_string(s) + ": goto s" + to_string(s) + ";\n";
+  }
+  out += "  default: (void) p; (void) end; return state;\n";
+  out += "  }\n";
+  for (int s=0; s < n; s++) {
+    string self = to_string(s);
+    out += " s" + self + ": // " + commentSafe(fsm.getState(s)->label) + "\n";
+    out += "  if (p == end) return " + self + ";\n";
+    int fail = rows[s].failure >= 0 ? rows[s].failure : s;
+    out += "  switch ((int) *p++) {\n";
+    for (size_t i=0; i < rows[s].cases.size(); i++) {
+      int sig = rows[s].cases[i].first;
+      if (sig < -128 || sig > 255 || rows[s].cases[i].second == fail) {
+	continue;
+      }
+      out += "  case " + to_string(sig) + ": goto s" +
+	to_string(rows[s].cases[i].second) + ";\n";
+    }
+    out += "  default: goto s" + to_string(fail) + ";\n";
+    out += "  }\n";
+  }
+  out += "}\n\n";
+
+  out += "} // extern \"C\"\n";
+  return out;
+}
@@ -0,0 +1,41 @@
+//
+// fsm_codegen.hpp
+//
+// Turns an FSM into standalone C++ source that recognizes the same
+// inputs without any tables.
+//
+
+#ifndef __fsm_codegen_h__
+#define __fsm_codegen_h__
+
+#include <string>
+#include "fsm.hpp"
+
+using namespace std;
+
+// generateCpp returns C++ source for a recognizer that behaves like
+// the FSM, in the spirit of re2c: every state becomes a block of code
+// with its signals as case labels and its failure transition as the
+// default branch, so the compiler can lay the machine out as plain
+// jumps. The source needs only the standard library and defines these
+// functions, with C linkage so they can be looked up by name:
+//
+//   int <prefix>_start();
+//     returns the default state, or -1 if the FSM had no states.
+//
+//   int <prefix>_next(int state, int signal);
+//     returns the state reached on the signal, or -1 if
+//     FSM::handleSignal would not take a transition.
+//
+//   int <prefix>_run(int state, const char* data, size_t size);
+//     feeds each byte to the machine as (int) c, like
+//     FSM::handleSignals, and returns the final state.
+//
+//   int <prefix>_accepts(int state);
+//     returns 1 if the state accepts and 0 otherwise.
+//
+// Unknown states are returned unchanged by _run, lead to -1 in
+// _next, and don't accept. The prefix must be a valid identifier.
+string generateCpp(FSM& fsm, const string& prefix);
+
+#endif
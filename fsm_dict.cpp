@@ -0,0 +1,364 @@
+//
+// fsm_dict.cpp
+//
+
+#include "fsm_dict.hpp"
+#include <algorithm>
+
+using namespace std;
+
+AhoCorasick::AhoCorasick() {
+}
+
+int AhoCorasick::addKeyword(string_view word) {
+  if (word.empty()) {
+    return -1;
+  }
+  string key(word);
+  unordered_map<string, int>::iterator it = keyword_ids.find(key);
+  if (it != keyword_ids.end()) {
+    return it->second;
+  }
+  int id = (int) keywords.size();
+  keywords.push_back(key);
+  keyword_ids[key] = id;
+  return id;
+}
+
+int AhoCorasick::countKeywords() {
+  return (int) keywords.size();
+}
+
+string AhoCorasick::getKeyword(int id) {
+  if (id < 0 || id >= (int) keywords.size()) {
+    return "";
+  }
+  return keywords[id];
+}
+
+FSM& AhoCorasick::build() {
+  // 1. the trie. Children are kept sorted by byte.
+  vector<vector<pair<unsigned char, int> > > children(1);
+  vector<int> ends(1, -1);
+  for (size_t k=0; k < keywords.size(); k++) {
+    int node = 0;
+    for (size_t i=0; i < keywords[k].size(); i++) {
+      unsigned char c = keywords[k][i];
+      vector<pair<unsigned char, int> >& kids = children[node];
+      vector<pair<unsigned char, int> >::iterator it =
+	lower_bound(kids.begin(), kids.end(), make_pair(c, -1));
+      if (it != kids.end() && it->first == c) {
+	node = it->second;
+      } else {
+	int child = (int) children.size();
+	kids.insert(it, make_pair(c, child));
+	children.push_back(vector<pair<unsigned char, int> >());
+	ends.push_back(-1);
+	node = child;
+      }
+    }
+    ends[node] = (int) k;
+  }
+  int n = (int) children.size();
+
+  // child returns the node reached from `node` on byte c, or -1.
+  auto child = [&](int node, unsigned char c) -> int {
+    const vector<pair<unsigned char, int> >& kids = children[node];
+    vector<pair<unsigned char, int> >::const_iterator it =
+      lower_bound(kids.begin(), kids.end(), make_pair(c, -1));
+    if (it != kids.end() && it->first == c) {
+      return it->second;
+    }
+    return -1;
+  };
+
+  // 2. failure links in breadth-first order, so a node's link is
+  // always a shallower node that has been handled already.
+  vector<int> order(1, 0);
+  vector<int> fail(n, 0);
+  vector<string> labels(n);
+  for (size_t i=0; i < order.size(); i++) {
+    int u = order[i];
+    for (size_t j=0; j < children[u].size(); j++) {
+      unsigned char c = children[u][j].first;
+      int v = children[u][j].second;
+      labels[v] = labels[u] + (char) c;
+      if (u != 0) {
+	int f = fail[u];
+	while (f != 0 && child(f, c) < 0) {
+	  f = fail[f];
+	}
+	int g = child(f, c);
+	fail[v] = g >= 0 ? g : 0;
+      }
+      order.push_back(v);
+    }
+  }
+
+  // 3. flatten. A node's row of transitions is its failure link's row
+  // with the node's own children layered on top. Only entries that
+  // lead somewhere other than the root are stored.
+  vector<vector<pair<unsigned char, int> > > rows(n);
+  rows[0] = children[0];
+  size_t total = 0;
+  for (size_t i=1; i < order.size(); i++) {
+    int v = order[i];
+    const vector<pair<unsigned char, int> >& inherited = rows[fail[v]];
+    const vector<pair<unsigned char, int> >& own = children[v];
+    vector<pair<unsigned char, int> >& row = rows[v];
+    size_t a = 0;
+    size_t b = 0;
+    while (a < inherited.size() || b < own.size()) {
+      if (b == own.size() ||
+	  (a < inherited.size() && inherited[a].first < own[b].first)) {
+	row.push_back(inherited[a++]);
+      } else {
+	if (a < inherited.size() && inherited[a].first == own[b].first) {
+	  a++;
+	}
+	row.push_back(own[b++]);
+      }
+    }
+    total += row.size();
+  }
+
+  // 4. emit the FSM with states numbered in breadth-first order.
+  vector<int> id(n);
+  for (int i=0; i < n; i++) {
+    id[order[i]] = i;
+  }
+  fsm = FSM();
+  fsm.reserve(n, (int) total + n);
+  keyword_at.assign(n, -1);
+  output_link.assign(n, -1);
+  for (int i=0; i < n; i++) {
+    int v = order[i];
+    int f = fail[v];
+    keyword_at[i] = ends[v];
+    output_link[i] = v == 0 ? -1 : (ends[f] >= 0 ? id[f] : output_link[id[f]]);
+    fsm.addState(labels[v], keyword_at[i] >= 0 || output_link[i] >= 0);
+  }
+  for (int i=0; i < n; i++) {
+    const vector<pair<unsigned char, int> >& row = rows[order[i]];
+    // byte 0xff reads as FAILURE_SIGNAL through (int) c, so it can
+    // only ever take the failure transition. Its target becomes the
+    // failure target and every byte that goes elsewhere gets its own
+    // transition. That target is the root unless a keyword uses 0xff.
+    int fail_target = 0;
+    if (!row.empty() && row.back().first == 0xff) {
+      fail_target = id[row.back().second];
+    }
+    size_t j = 0;
+    for (int b=0; b < 255; b++) {
+      int target = 0;
+      if (j < row.size() && row[j].first == b) {
+	target = id[row[j++].second];
+      } else if (fail_target == 0) {
+	continue;
+      }
+      if (target != fail_target) {
+	fsm.addTransition(i, target, (int) (char) b, string(1, (char) b));
+      }
+    }
+    fsm.addTransition(i, fail_target, FAILURE_SIGNAL, "fail");
+  }
+  machine = fsm.compile();
+  return fsm;
+}
+
+FSM& AhoCorasick::getFSM() {
+  return fsm;
+}
+
+const CompiledFSM& AhoCorasick::getMachine() const {
+  return machine;
+}
+
+void AhoCorasick::getMatches(int state, vector<int>& ids) const {
+  if (state < 0 || state >= (int) keyword_at.size()) {
+    return;
+  }
+  if (keyword_at[state] < 0) {
+    state = output_link[state];
+  }
+  while (state >= 0) {
+    ids.push_back(keyword_at[state]);
+    state = output_link[state];
+  }
+}
+
+void AhoCorasick::scan(string_view text, vector<KeywordMatch>& matches) const {
+  int state = machine.getDefaultState();
+  if (state < 0) {
+    return;
+  }
+  vector<int> ids;
+  for (size_t i=0; i < text.size(); i++) {
+    state = machine.nextState(state, (int) text[i]);
+    if (machine.isAcceptState(state)) {
+      ids.clear();
+      getMatches(state, ids);
+      for (size_t j=0; j < ids.size(); j++) {
+	KeywordMatch m;
+	m.end = i + 1;
+	m.keyword = ids[j];
+	matches.push_back(m);
+      }
+    }
+  }
+}
+
+DictionaryBuilder::DictionaryBuilder() {
+  fsm.addState("start");
+  fsm.addState("reject");
+  path.resize(1);
+  path[0].accept = false;
+  path[0].final_output = 0;
+  previous_value = 0;
+  num_words = 0;
+  finished = false;
+}
+
+bool DictionaryBuilder::addWord(string_view word) {
+  return addWord(word, 0);
+}
+
+bool DictionaryBuilder::addWord(string_view word, uint64_t value) {
+  if (finished) {
+    return false;
+  }
+  if (num_words > 0) {
+    int cmp = word.compare(previous);
+    if (cmp < 0) {
+      return false;
+    } else if (cmp == 0) {
+      return value == previous_value;
+    }
+  }
+
+  // everything past the prefix shared with the previous word is
+  // final now, since later words sort after this one.
+  size_t common = 0;
+  while (common < word.size() && common < previous.size() &&
+	 word[common] == previous[common]) {
+    common++;
+  }
+  freezeTo(common);
+  for (size_t i=common; i < word.size(); i++) {
+    PendingEdge e = { (unsigned char) word[i], -1, 0 };
+    path.back().edges.push_back(e);
+    PendingState next;
+    next.accept = false;
+    next.final_output = 0;
+    path.push_back(next);
+  }
+  path.back().accept = true;
+
+  // walk the shared prefix, keeping on each edge only the part of its
+  // output the new word can share. Whatever is left over moves one
+  // state further, onto every way out of the next state, so the
+  // words already below it keep their values.
+  uint64_t rest = value;
+  for (size_t i=0; i < common; i++) {
+    PendingEdge& e = path[i].edges.back();
+    uint64_t shared = min(e.output, rest);
+    uint64_t pushed = e.output - shared;
+    e.output = shared;
+    rest -= shared;
+    if (pushed > 0) {
+      PendingState& next = path[i + 1];
+      for (size_t j=0; j < next.edges.size(); j++) {
+	next.edges[j].output += pushed;
+      }
+      if (next.accept) {
+	next.final_output += pushed;
+      }
+    }
+  }
+  if (common < word.size()) {
+    path[common].edges.back().output = rest;
+  } else {
+    path[common].final_output = rest;
+  }
+
+  previous.assign(word.data(), word.size());
+  previous_value = value;
+  num_words++;
+  return true;
+}
+
+int DictionaryBuilder::countWords() {
+  return num_words;
+}
+
+FSM& DictionaryBuilder::finish() {
+  if (!finished) {
+    freezeTo(0);
+    fsm.getState(0)->accept = path[0].accept;
+    fsm.getState(0)->final_output = path[0].final_output;
+    addEdges(0, path[0]);
+    path.clear();
+    registry.clear();
+    finished = true;
+  }
+  return fsm;
+}
+
+void DictionaryBuilder::freezeTo(size_t depth) {
+  while (path.size() > depth + 1) {
+    int id = registerState(path.back());
+    path.pop_back();
+    path.back().edges.back().target = id;
+  }
+}
+
+int DictionaryBuilder::registerState(const PendingState& st) {
+  // the signature is the accept flag and final output followed by
+  // every edge. All targets are registered already, so equal
+  // signatures mean equal right languages with equal outputs.
+  string key(1, st.accept ? 1 : 0);
+  if (st.final_output != 0) {
+    key.append((const char*) &st.final_output, sizeof(uint64_t));
+  }
+  for (size_t i=0; i < st.edges.size(); i++) {
+    const PendingEdge& e = st.edges[i];
+    key += (char) e.byte;
+    key.append((const char*) &e.target, sizeof(int));
+    key.append((const char*) &e.output, sizeof(uint64_t));
+  }
+  unordered_map<string, int>::iterator it = registry.find(key);
+  if (it != registry.end()) {
+    return it->second;
+  }
+  int id = fsm.addState("", st.accept);
+  fsm.getState(id)->final_output = st.final_output;
+  addEdges(id, st);
+  registry[key] = id;
+  return id;
+}
+
+void DictionaryBuilder::addEdges(int id, const PendingState& st) {
+  // byte 0xff reads as FAILURE_SIGNAL through (int) c, so it can only
+  // ever take the failure transition. If the state has an 0xff edge,
+  // that edge becomes the failure transition and every byte without
+  // an edge of its own has to be sent to the sink explicitly.
+  int fail_target = 1;
+  uint64_t fail_output = 0;
+  if (!st.edges.empty() && st.edges.back().byte == 0xff) {
+    fail_target = st.edges.back().target;
+    fail_output = st.edges.back().output;
+  }
+  size_t j = 0;
+  for (int b=0; b < 255; b++) {
+    if (j < st.edges.size() && st.edges[j].byte == b) {
+      fsm.addTransition(id, st.edges[j].target, (int) (char) b,
+			string(1, (char) b), st.edges[j].output);
+      j++;
+    } else if (fail_target != 1) {
+      fsm.addTransition(id, 1, (int) (char) b, "reject");
+    } else if (j == st.edges.size()) {
+      break;
+    }
+  }
+  fsm.addTransition(id, fail_target, FAILURE_SIGNAL, "reject", fail_output);
+}
@@ -0,0 +1,182 @@
+//
+// fsm_dict.hpp
+//
+// Builders for dictionary-style machines that recognize large sets
+// of words.
+//
+
+#ifndef __fsm_dict_h__
+#define __fsm_dict_h__
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "fsm.hpp"
+
+using namespace std;
+
+// KeywordMatch is one occurrence of a keyword found by
+// AhoCorasick::scan.
+class KeywordMatch {
+public:
+  size_t end;  // offset just past the keyword's last byte
+  int keyword; // the keyword's ID from AhoCorasick::addKeyword
+};
+
+// AhoCorasick builds a machine that scans a stream for many keywords
+// at once. The keywords form a trie, and each trie node gets an
+// Aho-Corasick failure link to the node for its longest proper
+// suffix that is also in the trie, so a mismatch falls back to the
+// longest partial match still alive instead of starting over. The
+// failure links are then flattened away: every state gets a direct
+// transition for every byte, which makes the result an ordinary
+// deterministic FSM that handles each byte with one transition.
+//
+// A state accepts when at least one keyword ends at the byte that led
+// to it. Signals are (int) c for each byte c, like
+// FSM::handleSignals.
+class AhoCorasick {
+private:
+  vector<string> keywords; // a keyword's index is its ID
+
+  unordered_map<string, int> keyword_ids; // finds duplicate keywords
+
+  FSM fsm; // the flattened machine. Empty until build().
+
+  CompiledFSM machine; // fsm, compiled for scanning
+
+  vector<int> keyword_at; // the keyword that ends exactly at each
+			  // state, or -1
+
+  vector<int> output_link; // the next state along the failure chain
+			   // with outputs of its own, or -1
+
+public:
+
+  // AhoCorasick constructs a builder with no keywords.
+  AhoCorasick();
+
+  // addKeyword adds a keyword and returns its ID, which is its index
+  // in the order keywords were added. Adding a keyword that is
+  // already present returns the existing ID. Empty keywords can't be
+  // matched and return -1. Keywords added after build() only take
+  // effect on the next build().
+  int addKeyword(string_view word);
+
+  // countKeywords returns the number of distinct keywords added.
+  int countKeywords();
+
+  // getKeyword returns the keyword with the given ID, or an empty
+  // string if there is no such keyword.
+  string getKeyword(int id);
+
+  // build constructs the machine for the keywords added so far and
+  // returns it. State 0 is the start state, for the empty prefix.
+  FSM& build();
+
+  // getFSM returns the machine from the last build().
+  FSM& getFSM();
+
+  // getMachine returns the compiled form of getFSM().
+  const CompiledFSM& getMachine() const;
+
+  // getMatches appends the IDs of every keyword that ends when the
+  // machine enters the given state, longest first.
+  void getMatches(int state, vector<int>& ids) const;
+
+  // scan runs the machine over the text from the start state and
+  // appends every keyword occurrence to `matches`, in order of their
+  // end offsets and, for the same end, longest first.
+  void scan(string_view text, vector<KeywordMatch>& matches) const;
+};
+
+// DictionaryBuilder builds the minimal deterministic FSM that accepts
+// exactly the words it is given, which must arrive in sorted byte
+// order. It follows Daciuk et al.'s incremental algorithm: only the
+// states along the most recent word are kept unfinished, and as soon
+// as a later word moves past one of them it is either replaced by an
+// identical state already in the FSM or registered as a new one. The
+// full trie never exists, so peak memory stays close to the size of
+// the final machine.
+//
+// Each word can also carry a value, which turns the result into a
+// transducer mapping words to values the way a Lucene FST does:
+// FSM::transduce or PackedFSM::transduce on a word adds up the
+// outputs along its path to give back its value. Outputs are pushed
+// as close to the start state as they can go, so words that share a
+// prefix share its output and states with the same suffixes and
+// outputs are still merged.
+//
+// State 0 is the start state and state 1 is a rejecting sink that
+// every other state's failure transition leads to, so any input that
+// leaves the dictionary stays rejected. Signals are (int) c for each
+// byte c, like FSM::handleSignals.
+class DictionaryBuilder {
+private:
+  // PendingEdge is a transition out of a PendingState.
+  struct PendingEdge {
+    unsigned char byte;
+    int target;      // FSM state id, or -1 while still pending
+    uint64_t output; // transition output
+  };
+
+  // PendingState is a state on the path of the most recent word that
+  // may still gain transitions. Its last edge leads to the next state
+  // on the path, whose FSM id is not known until it is registered.
+  struct PendingState {
+    bool accept;
+    uint64_t final_output;
+    vector<PendingEdge> edges; // sorted by byte
+  };
+
+  FSM fsm; // the registered states
+
+  vector<PendingState> path; // path[0] is the start state
+
+  unordered_map<string, int> registry; // state signature -> FSM id
+
+  string previous; // the last word added
+
+  uint64_t previous_value; // the last word's value
+
+  int num_words; // distinct words added
+
+  bool finished; // true once finish() has run
+
+  // registerState returns the FSM id of a state identical to the
+  // given one, adding it to the FSM first if there is none.
+  int registerState(const PendingState& st);
+
+  // freezeTo registers every pending state deeper than `depth`.
+  void freezeTo(size_t depth);
+
+  // addEdges gives FSM state `id` the transitions of `st`.
+  void addEdges(int id, const PendingState& st);
+
+public:
+
+  // DictionaryBuilder constructs a builder with no words.
+  DictionaryBuilder();
+
+  // addWord adds the next word with a value of 0. It returns false
+  // without changing anything if the word sorts before the previous
+  // one, or if finish() has already been called. Adding the previous
+  // word again does nothing and returns true.
+  bool addWord(string_view word);
+
+  // addWord adds the next word and the value the finished FSM maps it
+  // to. It returns false without changing anything where the other
+  // addWord would, or if the word is the previous word with a
+  // different value.
+  bool addWord(string_view word, uint64_t value);
+
+  // countWords returns the number of distinct words added.
+  int countWords();
+
+  // finish registers the remaining states and returns the FSM. Later
+  // calls return the same FSM.
+  FSM& finish();
+};
+
+#endif
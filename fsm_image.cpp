@@ -0,0 +1,326 @@
+//
+// fsm_image.cpp
+//
+
+#include "fsm_image.hpp"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+
+using namespace std;
+
+static_assert(sizeof(int) == sizeof(int32_t), "images store ints as int32_t");
+static_assert(sizeof(ImageHeader) % 8 == 0, "sections must stay aligned");
+
+namespace {
+
+const char image_magic[8] = { 'F', 'S', 'M', 'I', 'M', 'A', 'G', 'E' };
+
+const uint32_t image_byte_order = 0x01020304;
+
+// checksum hashes n bytes eight at a time. It only has to catch
+// truncated or corrupted files, not resist attackers.
+uint64_t checksum(const char* p, size_t n) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ n;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h ^= w * 0xbf58476d1ce4e5b9ULL;
+    h = ((h << 31) | (h >> 33)) * 0x94d049bb133111ebULL;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, p + i, n - i);
+  h ^= tail * 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 29;
+  return h;
+}
+
+// appendSection pads the image to an 8 byte boundary, appends the
+// bytes and returns the offset they start at.
+uint64_t appendSection(string& image, const void* data, size_t size) {
+  image.resize((image.size() + 7) & ~(size_t) 7, '\0');
+  uint64_t offset = image.size();
+  image.append((const char*) data, size);
+  return offset;
+}
+
+// inRange returns true if each of the n values is in [lo, hi).
+bool inRange(const int32_t* values, size_t n, int32_t lo, int32_t hi) {
+  for (size_t i=0; i < n; i++) {
+    if (values[i] < lo || values[i] >= hi) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+MappedFSM::MappedFSM() {
+  mapping = NULL;
+  mapping_size = 0;
+  close();
+}
+
+MappedFSM::~MappedFSM() {
+  close();
+}
+
+string MappedFSM::encode(FSM& fsm, bool with_labels) {
+  CompiledFSM c = fsm.compile();
+  const SignalMap& m = c.signals;
+
+  ImageHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, image_magic, sizeof(h.magic));
+  h.version = FSM_IMAGE_VERSION;
+  h.byte_order = image_byte_order;
+  h.num_states = c.num_states;
+  h.num_classes = c.num_classes;
+  h.default_state = c.default_state;
+  h.num_sparse = (int32_t) m.sparse_signals.size();
+
+  string image(sizeof(h), '\0');
+  h.byte_class = appendSection(image, m.byte_class, sizeof(m.byte_class));
+  h.char_class = appendSection(image, c.char_class, sizeof(c.char_class));
+  h.sparse_signals = appendSection(image, m.sparse_signals.data(),
+				   m.sparse_signals.size() * sizeof(int32_t));
+  h.sparse_classes = appendSection(image, m.sparse_class.data(),
+				   m.sparse_class.size() * sizeof(int32_t));
+  h.next_state = appendSection(image, c.next_state.data(),
+			       c.next_state.size() * sizeof(int32_t));
+  h.accept_bits = appendSection(image, c.accept_bits.data(),
+				c.accept_bits.size() * sizeof(uint64_t));
+  if (with_labels) {
+    vector<uint64_t> offsets(1, 0);
+    string chars;
+    for (int s=0; s < c.num_states; s++) {
+      chars += fsm.getState(s)->label;
+      offsets.push_back(chars.size());
+    }
+    h.label_offsets = appendSection(image, offsets.data(),
+				    offsets.size() * sizeof(uint64_t));
+    h.label_chars = appendSection(image, chars.data(), chars.size());
+  }
+  image.resize((image.size() + 7) & ~(size_t) 7, '\0');
+
+  h.file_size = image.size();
+  h.checksum = checksum(image.data() + sizeof(h), image.size() - sizeof(h));
+  memcpy(&image[0], &h, sizeof(h));
+  return image;
+}
+
+bool MappedFSM::save(FSM& fsm, const string& path, bool with_labels) {
+  string image = encode(fsm, with_labels);
+  FILE* f = fopen(path.c_str(), "wb");
+  if (f == NULL) {
+    return false;
+  }
+  bool ok = fwrite(image.data(), 1, image.size(), f) == image.size();
+  return fclose(f) == 0 && ok;
+}
+
+bool MappedFSM::open(const string& path, bool verify) {
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    error = "can't open " + path;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    ::close(fd);
+    error = "can't read " + path;
+    return false;
+  }
+  size_t size = (size_t) st.st_size;
+  void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    error = "can't map " + path;
+    return false;
+  }
+  if (!load(p, size, verify)) {
+    munmap(p, size);
+    return false;
+  }
+  mapping = p;
+  mapping_size = size;
+  return true;
+}
+
+bool MappedFSM::load(const void* data, size_t size, bool verify) {
+  close();
+  const char* base = (const char*) data;
+  if (((uintptr_t) base & 7) != 0) {
+    error = "image is not 8 byte aligned";
+    return false;
+  }
+  if (size < sizeof(ImageHeader)) {
+    error = "image is truncated";
+    return false;
+  }
+  const ImageHeader* h = (const ImageHeader*) base;
+  if (memcmp(h->magic, image_magic, sizeof(h->magic)) != 0) {
+    error = "not an FSM image";
+    return false;
+  }
+  if (h->byte_order != image_byte_order) {
+    error = "image was written with a different byte order";
+    return false;
+  }
+  if (h->version != FSM_IMAGE_VERSION) {
+    error = "unsupported image version " + to_string(h->version);
+    return false;
+  }
+  if (h->file_size != size) {
+    error = "image is truncated";
+    return false;
+  }
+  if (h->num_states < 0 || h->num_classes < 1 || h->num_sparse < 0 ||
+      h->default_state < -1 || h->default_state >= h->num_states) {
+    error = "image header is corrupt";
+    return false;
+  }
+
+  // every section has to lie inside the image, aligned.
+  uint64_t rows = (uint64_t) h->num_states * h->num_classes;
+  uint64_t sections[][2] = {
+    { h->byte_class, 256 * sizeof(int32_t) },
+    { h->char_class, 256 * sizeof(int32_t) },
+    { h->sparse_signals, h->num_sparse * sizeof(int32_t) },
+    { h->sparse_classes, h->num_sparse * sizeof(int32_t) },
+    { h->next_state, rows * sizeof(int32_t) },
+    { h->accept_bits, (h->num_states + 63) / 64 * sizeof(uint64_t) },
+    { h->label_offsets, h->label_offsets == 0 ? 0 :
+      (h->num_states + 1) * sizeof(uint64_t) },
+  };
+  for (size_t i=0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+    uint64_t offset = sections[i][0], len = sections[i][1];
+    if ((offset & 7) != 0 || offset > size || len > size - offset ||
+	(offset < sizeof(ImageHeader) && len > 0)) {
+      error = "image section out of bounds";
+      return false;
+    }
+  }
+  if (h->label_offsets != 0) {
+    const uint64_t* offsets = (const uint64_t*) (base + h->label_offsets);
+    if (h->label_chars > size ||
+	offsets[h->num_states] > size - h->label_chars) {
+      error = "image section out of bounds";
+      return false;
+    }
+  }
+  // every value the run path uses as an index has to be in range, or
+  // a damaged image could send it outside the table.
+  if (verify) {
+    const int32_t* sparse_signals = (const int32_t*) (base + h->sparse_signals);
+    bool ok = inRange((const int32_t*) (base + h->byte_class), 256, 0, h->num_classes) &&
+      inRange((const int32_t*) (base + h->char_class), 256, 0, h->num_classes) &&
+      inRange((const int32_t*) (base + h->sparse_classes), h->num_sparse,
+	      0, h->num_classes) &&
+      inRange((const int32_t*) (base + h->next_state), rows, -1, h->num_states);
+    for (int32_t i=1; ok && i < h->num_sparse; i++) {
+      ok = sparse_signals[i - 1] < sparse_signals[i];
+    }
+    if (h->label_offsets != 0) {
+      const uint64_t* offsets = (const uint64_t*) (base + h->label_offsets);
+      for (int32_t i=0; ok && i < h->num_states; i++) {
+	ok = offsets[i] <= offsets[i + 1];
+      }
+    }
+    if (!ok) {
+      error = "image contents are corrupt";
+      return false;
+    }
+  }
+  if (verify && checksum(base + sizeof(ImageHeader), size - sizeof(ImageHeader)) !=
+      h->checksum) {
+    error = "image checksum mismatch";
+    return false;
+  }
+
+  num_states = h->num_states;
+  num_classes = h->num_classes;
+  default_state = h->default_state;
+  num_sparse = h->num_sparse;
+  byte_class = (const int32_t*) (base + h->byte_class);
+  char_class = (const int32_t*) (base + h->char_class);
+  sparse_signals = (const int32_t*) (base + h->sparse_signals);
+  sparse_classes = (const int32_t*) (base + h->sparse_classes);
+  next_state = (const int32_t*) (base + h->next_state);
+  accept_bits = (const uint64_t*) (base + h->accept_bits);
+  if (h->label_offsets != 0) {
+    label_offsets = (const uint64_t*) (base + h->label_offsets);
+    label_chars = base + h->label_chars;
+  }
+  return true;
+}
+
+void MappedFSM::close() {
+  if (mapping != NULL) {
+    munmap(mapping, mapping_size);
+  }
+  mapping = NULL;
+  mapping_size = 0;
+  num_states = 0;
+  num_classes = 1;
+  default_state = -1;
+  num_sparse = 0;
+  byte_class = NULL;
+  char_class = NULL;
+  sparse_signals = NULL;
+  sparse_classes = NULL;
+  next_state = NULL;
+  accept_bits = NULL;
+  label_offsets = NULL;
+  label_chars = NULL;
+  error.clear();
+}
+
+string MappedFSM::getError() const {
+  return error;
+}
+
+bool MappedFSM::hasLabels() const {
+  return label_offsets != NULL;
+}
+
+string_view MappedFSM::getLabel(int id) const {
+  if (id < 0 || id >= num_states || label_offsets == NULL) {
+    return string_view();
+  }
+  return string_view(label_chars + label_offsets[id],
+		     label_offsets[id + 1] - label_offsets[id]);
+}
+
+int MappedFSM::run(int id, const int* begin, const int* end) const {
+  if (id < 0 || id >= num_states) {
+    return id;
+  }
+  size_t k = num_classes;
+  for (const int* p=begin; p != end; ++p) {
+    int next = next_state[id * k + classOf(*p)];
+    id = next < 0 ? id : next;
+  }
+  return id;
+}
+
+int MappedFSM::run(int id, string_view input) const {
+  if (id < 0 || id >= num_states) {
+    return id;
+  }
+  const int32_t* table = next_state;
+  size_t k = num_classes;
+  const unsigned char* p = (const unsigned char*) input.data();
+  const unsigned char* end = p + input.size();
+  for (; p != end; ++p) {
+    int next = table[id * k + char_class[*p]];
+    id = next < 0 ? id : next;
+  }
+  return id;
+}
@@ -0,0 +1,193 @@
+//
+// fsm_image.hpp
+//
+// A binary image format for compiled FSMs that can be mapped into
+// memory and run in place.
+//
+
+#ifndef __fsm_image_h__
+#define __fsm_image_h__
+
+#include <string>
+#include <string_view>
+#include <stdint.h>
+#include "fsm.hpp"
+
+using namespace std;
+
+#define FSM_IMAGE_VERSION 1
+
+// ImageHeader starts every image. An image is a single block of
+// native-endian data made of this header followed by the sections it
+// points to, each of which starts on an 8 byte boundary. Sections are
+// found by their offset from the start of the image, never by
+// address, so an image can be mapped anywhere and shared by any
+// number of processes through the page cache.
+//
+// The sections are:
+//   -- byte_class: 256 int32s, the signal class of signals 0-255
+//   -- char_class: 256 int32s, the class of each byte of a char
+//      input, indexed by (unsigned char) c
+//   -- sparse_signals, sparse_classes: num_sparse int32s each, the
+//      sorted signals outside 0-255 and their classes
+//   -- next_state: num_states rows of num_classes int32s, laid out
+//      like CompiledFSM's table. Column 0 of each row is the state's
+//      failure row entry: where signals no state mentions lead.
+//   -- accept_bits: (num_states + 63) / 64 uint64s
+//   -- label_offsets, label_chars: optional. num_states + 1 uint64s
+//      and the label bytes they index. Both offsets are 0 if the
+//      image has no labels.
+class ImageHeader {
+public:
+  char magic[8];         // "FSMIMAGE"
+  uint32_t version;      // FSM_IMAGE_VERSION
+  uint32_t byte_order;   // 0x01020304 as written by the producer
+  uint64_t file_size;    // size of the whole image in bytes
+  uint64_t checksum;     // of every byte after the header
+  int32_t num_states;
+  int32_t num_classes;
+  int32_t default_state; // -1 if the FSM had no states
+  int32_t num_sparse;    // entries in the sparse signal table
+  uint64_t byte_class;   // section offsets from the start of the image
+  uint64_t char_class;
+  uint64_t sparse_signals;
+  uint64_t sparse_classes;
+  uint64_t next_state;
+  uint64_t accept_bits;
+  uint64_t label_offsets;
+  uint64_t label_chars;
+};
+
+// MappedFSM runs a compiled FSM straight out of an image, which is
+// either a file it maps read-only or a buffer owned by the caller.
+// Nothing is copied or decoded when an image is opened; the accessors
+// read the image's sections in place. It offers the same machine
+// interface as CompiledFSM, so Cursors work with it too.
+class MappedFSM {
+private:
+  void* mapping;       // the file mapping, or NULL for caller buffers
+  size_t mapping_size; // length of `mapping`
+
+  int num_states;
+  int num_classes;
+  int default_state;
+  int num_sparse;
+
+  const int32_t* byte_class;
+  const int32_t* char_class;
+  const int32_t* sparse_signals;
+  const int32_t* sparse_classes;
+  const int32_t* next_state;
+  const uint64_t* accept_bits;
+  const uint64_t* label_offsets; // NULL if the image has no labels
+  const char* label_chars;
+
+  string error; // why the last open or load failed, if it did
+
+  // classOf returns the column the signal selects.
+  int classOf(int signal) const {
+    if ((unsigned) signal < 256) {
+      return byte_class[signal];
+    }
+    size_t i = lowerBound(sparse_signals, num_sparse, signal);
+    if (i < (size_t) num_sparse && sparse_signals[i] == signal) {
+      return sparse_classes[i];
+    }
+    return 0;
+  }
+
+  MappedFSM(const MappedFSM&);
+  MappedFSM& operator=(const MappedFSM&);
+
+public:
+
+  // MappedFSM constructs a machine with no states and no image.
+  MappedFSM();
+
+  // ~MappedFSM unmaps the file, if one is open.
+  ~MappedFSM();
+
+  // encode builds the image of the given FSM, as FSM::compile would
+  // produce it, and returns it. Labels are only included if
+  // with_labels is true.
+  static string encode(FSM& fsm, bool with_labels);
+
+  // save writes the image of the given FSM to a file. It returns
+  // false if the file could not be written.
+  static bool save(FSM& fsm, const string& path, bool with_labels);
+
+  // open maps an image file and starts using it, dropping any image
+  // used before. The header and section bounds are always checked,
+  // which keeps opening O(1). Only if `verify` is true is the whole
+  // image read, to check the checksum and that every class, state
+  // and label offset in it is in range. Running an image that was
+  // opened without `verify` trusts its contents: a damaged one can
+  // make run and getLabel read outside it. It returns false, leaving
+  // a message in getError() and the machine empty, if the file can't
+  // be used.
+  bool open(const string& path, bool verify);
+
+  // load starts using an image the caller keeps alive and unchanged
+  // for as long as this machine uses it. The data must be 8 byte
+  // aligned. Checks and errors are as for open.
+  bool load(const void* data, size_t size, bool verify);
+
+  // close drops the image, unmapping it if it was opened from a file,
+  // and leaves a machine with no states.
+  void close();
+
+  // getError returns the reason the last open or load failed, or an
+  // empty string if it succeeded.
+  string getError() const;
+
+  // countStates returns the number of states.
+  int countStates() const {
+    return num_states;
+  }
+
+  // countClasses returns the number of columns in each row.
+  int countClasses() const {
+    return num_classes;
+  }
+
+  // getDefaultState returns the default state's ID, or -1 if there
+  // are no states.
+  int getDefaultState() const {
+    return default_state;
+  }
+
+  // hasLabels returns true if the image has a label section.
+  bool hasLabels() const;
+
+  // getLabel returns the label of the given state, or an empty string
+  // for out of range ids and images without labels. The view points
+  // into the image.
+  string_view getLabel(int id) const;
+
+  // isAcceptState returns true if the given state is an accepting
+  // state. Out of range ids return false.
+  bool isAcceptState(int id) const {
+    if (id < 0 || id >= num_states) {
+      return false;
+    }
+    return (accept_bits[id >> 6] >> (id & 63)) & 1;
+  }
+
+  // nextState returns the state reached from the given state on the
+  // given signal, or -1 if the FSM would not take any transition. The
+  // state id must be valid.
+  int nextState(int id, int signal) const {
+    return next_state[(size_t) id * num_classes + classOf(signal)];
+  }
+
+  // run feeds every signal in [begin, end) to the machine starting in
+  // the given state and returns the state it ends in, like
+  // CompiledFSM::run.
+  int run(int id, const int* begin, const int* end) const;
+
+  // run feeds each character of the input to the machine, using
+  // (int) c as the signal. See the other run function for the rest.
+  int run(int id, string_view input) const;
+};
+
+#endif
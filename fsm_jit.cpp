@@ -0,0 +1,243 @@
+//
+// fsm_jit.cpp
+//
+
+#include "fsm_jit.hpp"
+#include <initializer_list>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define FSM_JIT_X86_64 1
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+#ifdef FSM_JIT_X86_64
+
+// states with more cases than this get a jump table instead of a
+// chain of compares.
+const size_t max_chain = 6;
+
+// Assembler collects machine code and the 32-bit relative references
+// that can only be filled in once every state's address is known.
+class Assembler {
+public:
+  vector<uint8_t> bytes;
+
+  // a rel32 at `at` that must point to state `state`'s block, counted
+  // from the end of the field.
+  vector<pair<size_t, int> > jumps;
+
+  // a rel32 at `at` that must point to the byte offset `target`.
+  vector<pair<size_t, size_t> > refs;
+
+  void emit(std::initializer_list<uint8_t> code) {
+    bytes.insert(bytes.end(), code.begin(), code.end());
+  }
+
+  void emit32(uint32_t v) {
+    for (int i=0; i < 4; i++) {
+      bytes.push_back((uint8_t) (v >> (8 * i)));
+    }
+  }
+
+  void patch32(size_t at, uint32_t v) {
+    for (int i=0; i < 4; i++) {
+      bytes[at + i] = (uint8_t) (v >> (8 * i));
+    }
+  }
+
+  // jumpTo emits the rel32 of a jump to a state's block.
+  void jumpTo(int state) {
+    jumps.push_back(make_pair(bytes.size(), state));
+    emit32(0);
+  }
+
+  // align pads with int3 up to a multiple of n.
+  void align(size_t n) {
+    while (bytes.size() % n != 0) {
+      bytes.push_back(0xcc);
+    }
+  }
+};
+
+// generate writes code for the function
+//   int run(int state, const char* p, const char* end)
+// under the System V calling convention: edi = state, rsi = p and
+// rdx = end. The state must be valid.
+vector<uint8_t> generate(FSM& fsm) {
+  int n = fsm.countStates();
+  Assembler a;
+  vector<size_t> block(n);
+  vector<size_t> table_refs; // lea fields to point at each table,
+  vector<int> table_states;  // and the state each table is for
+
+  // dispatch: jump to the start state's block through a table of
+  // offsets relative to the table.
+  a.emit({ 0x89, 0xff });               // mov edi, edi
+  a.emit({ 0x4c, 0x8d, 0x05 });         // lea r8, [rip + dispatch]
+  size_t dispatch_ref = a.bytes.size();
+  a.emit32(0);
+  a.emit({ 0x49, 0x63, 0x04, 0xb8 });   // movsxd rax, [r8 + rdi*4]
+  a.emit({ 0x4c, 0x01, 0xc0 });         // add rax, r8
+  a.emit({ 0xff, 0xe0 });               // jmp rax
+
+  vector<vector<pair<int, int> > > rows(n); // byte signal -> target
+  vector<int> fail(n);
+  for (int s=0; s < n; s++) {
+    State* st = fsm.getState(s);
+    fail[s] = st->failure_trans >= 0 ?
+      fsm.getTransition(st->failure_trans)->next_state : s;
+    for (size_t i=0; i < st->trans.size(); i++) {
+      int sig = st->signals[i];
+      if ((i > 0 && sig == st->signals[i-1]) || sig < -128 || sig > 127) {
+	continue; // never taken, or not a char
+      }
+      int target = fsm.getTransition(st->trans[i])->next_state;
+      if (target != fail[s]) {
+	rows[s].push_back(make_pair(sig, target));
+      }
+    }
+  }
+
+  for (int s=0; s < n; s++) {
+    a.align(16);
+    block[s] = a.bytes.size();
+    a.emit({ 0x48, 0x39, 0xd6 });       // cmp rsi, rdx
+    a.emit({ 0x0f, 0x84 });             // je exit
+    size_t exit_ref = a.bytes.size();
+    a.emit32(0);
+    if (rows[s].size() <= max_chain) {
+      a.emit({ 0x0f, 0xbe, 0x06 });     // movsx eax, byte [rsi]
+      a.emit({ 0x48, 0x83, 0xc6, 0x01 }); // add rsi, 1
+      for (size_t i=0; i < rows[s].size(); i++) {
+	a.emit({ 0x3d });               // cmp eax, imm32
+	a.emit32((uint32_t) rows[s][i].first);
+	a.emit({ 0x0f, 0x84 });         // je target
+	a.jumpTo(rows[s][i].second);
+      }
+      a.emit({ 0xe9 });                 // jmp fail
+      a.jumpTo(fail[s]);
+    } else {
+      a.emit({ 0x0f, 0xb6, 0x06 });     // movzx eax, byte [rsi]
+      a.emit({ 0x48, 0x83, 0xc6, 0x01 }); // add rsi, 1
+      a.emit({ 0x4c, 0x8d, 0x05 });     // lea r8, [rip + table]
+      table_refs.push_back(a.bytes.size());
+      table_states.push_back(s);
+      a.emit32(0);
+      a.emit({ 0x49, 0x63, 0x04, 0x80 }); // movsxd rax, [r8 + rax*4]
+      a.emit({ 0x4c, 0x01, 0xc0 });     // add rax, r8
+      a.emit({ 0xff, 0xe0 });           // jmp rax
+    }
+    a.patch32(exit_ref, (uint32_t) (a.bytes.size() - (exit_ref + 4)));
+    a.emit({ 0xb8 });                   // mov eax, s
+    a.emit32((uint32_t) s);
+    a.emit({ 0xc3 });                   // ret
+  }
+
+  // the dispatch table and the per-state jump tables hold offsets
+  // relative to their own start.
+  a.align(4);
+  size_t dispatch = a.bytes.size();
+  a.patch32(dispatch_ref, (uint32_t) (dispatch - (dispatch_ref + 4)));
+  for (int s=0; s < n; s++) {
+    a.emit32((uint32_t) (block[s] - dispatch));
+  }
+  for (size_t t=0; t < table_states.size(); t++) {
+    int s = table_states[t];
+    size_t table = a.bytes.size();
+    a.patch32(table_refs[t], (uint32_t) (table - (table_refs[t] + 4)));
+    vector<int> target(256, fail[s]);
+    for (size_t i=0; i < rows[s].size(); i++) {
+      target[(unsigned char) rows[s][i].first] = rows[s][i].second;
+    }
+    for (int b=0; b < 256; b++) {
+      a.emit32((uint32_t) (block[target[b]] - table));
+    }
+  }
+
+  for (size_t i=0; i < a.jumps.size(); i++) {
+    size_t at = a.jumps[i].first;
+    a.patch32(at, (uint32_t) (block[a.jumps[i].second] - (at + 4)));
+  }
+  return a.bytes;
+}
+
+#endif
+
+} // namespace
+
+JitFSM::JitFSM() {
+  code = NULL;
+  code_size = 0;
+  entry = NULL;
+}
+
+JitFSM::~JitFSM() {
+  release();
+}
+
+void JitFSM::release() {
+#ifdef FSM_JIT_X86_64
+  if (code != NULL) {
+    munmap(code, code_size);
+  }
+#endif
+  code = NULL;
+  code_size = 0;
+  entry = NULL;
+}
+
+bool JitFSM::isSupported() {
+#ifdef FSM_JIT_X86_64
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool JitFSM::compile(FSM& fsm) {
+  release();
+  packed = fsm.pack();
+#ifdef FSM_JIT_X86_64
+  if (fsm.countStates() == 0) {
+    return false;
+  }
+  vector<uint8_t> bytes = generate(fsm);
+  void* p = mmap(NULL, bytes.size(), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+  memcpy(p, bytes.data(), bytes.size());
+  if (mprotect(p, bytes.size(), PROT_READ | PROT_EXEC) != 0) {
+    munmap(p, bytes.size());
+    return false;
+  }
+  code = p;
+  code_size = bytes.size();
+  entry = (Entry) p;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool JitFSM::isNative() const {
+  return entry != NULL;
+}
+
+int JitFSM::countStates() const {
+  return packed.countStates();
+}
+
+int JitFSM::getDefaultState() const {
+  return packed.getDefaultState();
+}
+
+int JitFSM::run(int id, const int* begin, const int* end) const {
+  return packed.run(id, begin, end);
+}
@@ -0,0 +1,102 @@
+//
+// fsm_jit.hpp
+//
+// An optional x86-64 JIT that turns an FSM into native code.
+//
+
+#ifndef __fsm_jit_h__
+#define __fsm_jit_h__
+
+#include <string_view>
+#include "fsm.hpp"
+
+using namespace std;
+
+// JitFSM compiles an FSM into x86-64 machine code for running over
+// char input. Every state becomes a block of code that reads the next
+// byte and jumps straight to the next state's block: states with few
+// transitions compare the byte against each signal in turn, and
+// busier states index a 256-entry jump table. The failure transition
+// is the fallthrough, and a state with neither a match nor a failure
+// transition jumps back to itself, exactly as FSM::handleSignal
+// stays put. The code is written to an anonymous mapping that is made
+// executable, and no longer writable, before it is used.
+//
+// Where the JIT is not available (anything but x86-64 Linux), or the
+// mapping can't be made, compile still succeeds but run falls back to
+// a PackedFSM. Int signal input and nextState always use that
+// PackedFSM, so JitFSM offers the same machine interface as the other
+// machine forms and works with Cursors.
+class JitFSM {
+private:
+  typedef int (*Entry)(int state, const char* begin, const char* end);
+
+  PackedFSM packed; // the interpreter, for everything but char runs
+
+  void* code;       // the executable mapping, or NULL
+  size_t code_size; // length of `code`
+  Entry entry;      // start of the generated code, or NULL
+
+  // release unmaps the generated code, if there is any.
+  void release();
+
+  JitFSM(const JitFSM&);
+  JitFSM& operator=(const JitFSM&);
+
+public:
+
+  // JitFSM constructs a machine with no states.
+  JitFSM();
+
+  // ~JitFSM unmaps the generated code.
+  ~JitFSM();
+
+  // isSupported returns true if this build can generate native code.
+  static bool isSupported();
+
+  // compile replaces the machine with one built from the FSM's
+  // current states and transitions. It returns true if native code
+  // was generated, and false if run will use the interpreter.
+  bool compile(FSM& fsm);
+
+  // isNative returns true if char input runs generated code.
+  bool isNative() const;
+
+  // countStates returns the number of states.
+  int countStates() const;
+
+  // getDefaultState returns the default state's ID, or -1 if there
+  // are no states.
+  int getDefaultState() const;
+
+  // isAcceptState returns true if the given state is an accepting
+  // state. Out of range ids return false.
+  bool isAcceptState(int id) const {
+    return packed.isAcceptState(id);
+  }
+
+  // nextState returns the state reached from the given state on the
+  // given signal, or -1 if the FSM would not take any transition.
+  // The state id must be valid.
+  int nextState(int id, int signal) const {
+    return packed.nextState(id, signal);
+  }
+
+  // run feeds every signal in [begin, end) to the machine starting in
+  // the given state and returns the state it ends in, like
+  // PackedFSM::run.
+  int run(int id, const int* begin, const int* end) const;
+
+  // run feeds each character of the input to the machine, using
+  // (int) c as the signal, and returns the state it ends in. Signals
+  // with no transition leave the state unchanged, and an invalid
+  // start state is returned as is.
+  int run(int id, string_view input) const {
+    if (entry == NULL || id < 0 || id >= packed.countStates()) {
+      return packed.run(id, input);
+    }
+    return entry(id, input.data(), input.data() + input.size());
+  }
+};
+
+#endif
@@ -0,0 +1,552 @@
+//
+// fsm_regex.cpp
+//
+
+#include "fsm_regex.hpp"
+#include <algorithm>
+#include <unordered_map>
+
+using namespace std;
+
+namespace {
+
+// ByteSet is a set of byte values, 0 to 255.
+struct ByteSet {
+  uint64_t words[4];
+
+  ByteSet() {
+    words[0] = words[1] = words[2] = words[3] = 0;
+  }
+
+  void add(int b) {
+    words[b >> 6] |= (uint64_t) 1 << (b & 63);
+  }
+
+  void addRange(int lo, int hi) {
+    for (int b=lo; b <= hi; b++) {
+      add(b);
+    }
+  }
+
+  void addAll(const ByteSet& other) {
+    for (int i=0; i < 4; i++) {
+      words[i] |= other.words[i];
+    }
+  }
+
+  void invert() {
+    for (int i=0; i < 4; i++) {
+      words[i] = ~words[i];
+    }
+  }
+
+  bool has(int b) const {
+    return (words[b >> 6] >> (b & 63)) & 1;
+  }
+};
+
+// the kinds of node in a Thompson NFA.
+enum NodeType {
+  CHARS, // consumes one byte in `chars` and moves to `out`
+  SPLIT, // moves to both `out` and `out2` without consuming input
+  EMPTY, // moves to `out` without consuming input
+  START, // moves to `out` only at the start of the input (`^`)
+  END,   // moves to `out` only at the end of the input (`$`)
+  MATCH  // the pattern has matched
+};
+
+struct Node {
+  NodeType type;
+  ByteSet chars;
+  int out;
+  int out2;
+};
+
+// Frag is a partly built piece of NFA: where it starts, and the node
+// outputs (node id, 0 for `out` or 1 for `out2`) still waiting to be
+// connected to whatever comes next.
+struct Frag {
+  int start;
+  vector<pair<int, int> > dangling;
+};
+
+// Parser turns a pattern into Thompson NFA nodes by recursive
+// descent. Every parse function returns false and sets `error` when
+// the pattern is malformed.
+class Parser {
+public:
+  string_view pattern;
+  size_t pos;
+  vector<Node>& nodes;
+  string& error;
+
+  Parser(string_view pattern, vector<Node>& nodes, string& error)
+    : pattern(pattern), pos(0), nodes(nodes), error(error) {}
+
+  int addNode(NodeType type) {
+    Node n;
+    n.type = type;
+    n.out = -1;
+    n.out2 = -1;
+    nodes.push_back(n);
+    return (int) nodes.size() - 1;
+  }
+
+  void patch(const vector<pair<int, int> >& dangling, int target) {
+    for (size_t i=0; i < dangling.size(); i++) {
+      if (dangling[i].second == 0) {
+	nodes[dangling[i].first].out = target;
+      } else {
+	nodes[dangling[i].first].out2 = target;
+      }
+    }
+  }
+
+  bool fail(const string& why) {
+    error = why + " at offset " + to_string(pos);
+    return false;
+  }
+
+  bool atEnd() {
+    return pos >= pattern.size();
+  }
+
+  // alt := concat ('|' concat)*
+  bool parseAlt(Frag& f) {
+    if (!parseConcat(f)) {
+      return false;
+    }
+    while (!atEnd() && pattern[pos] == '|') {
+      pos++;
+      Frag right;
+      if (!parseConcat(right)) {
+	return false;
+      }
+      int split = addNode(SPLIT);
+      nodes[split].out = f.start;
+      nodes[split].out2 = right.start;
+      f.start = split;
+      f.dangling.insert(f.dangling.end(), right.dangling.begin(), right.dangling.end());
+    }
+    return true;
+  }
+
+  // concat := repeat*, which may be empty.
+  bool parseConcat(Frag& f) {
+    bool any = false;
+    while (!atEnd() && pattern[pos] != '|' && pattern[pos] != ')') {
+      Frag next;
+      if (!parseRepeat(next)) {
+	return false;
+      }
+      if (!any) {
+	f = next;
+	any = true;
+      } else {
+	patch(f.dangling, next.start);
+	f.dangling = next.dangling;
+      }
+    }
+    if (!any) {
+      f.start = addNode(EMPTY);
+      f.dangling.assign(1, make_pair(f.start, 0));
+    }
+    return true;
+  }
+
+  // repeat := atom ('*' | '+' | '?')*
+  bool parseRepeat(Frag& f) {
+    if (!parseAtom(f)) {
+      return false;
+    }
+    while (!atEnd()) {
+      char op = pattern[pos];
+      if (op == '{') {
+	return fail("{n,m} repetition is not supported");
+      }
+      if (op != '*' && op != '+' && op != '?') {
+	break;
+      }
+      pos++;
+      int split = addNode(SPLIT);
+      nodes[split].out = f.start;
+      if (op == '*') {
+	patch(f.dangling, split);
+	f.start = split;
+	f.dangling.assign(1, make_pair(split, 1));
+      } else if (op == '+') {
+	patch(f.dangling, split);
+	f.dangling.assign(1, make_pair(split, 1));
+      } else {
+	f.start = split;
+	f.dangling.push_back(make_pair(split, 1));
+      }
+    }
+    return true;
+  }
+
+  bool parseAtom(Frag& f) {
+    char c = pattern[pos];
+    ByteSet set;
+    if (c == '(') {
+      pos++;
+      if (!parseAlt(f)) {
+	return false;
+      }
+      if (atEnd() || pattern[pos] != ')') {
+	return fail("missing )");
+      }
+      pos++;
+      return true;
+    } else if (c == '*' || c == '+' || c == '?') {
+      return fail("nothing to repeat");
+    } else if (c == '{' || c == '}') {
+      return fail("{n,m} repetition is not supported");
+    } else if (c == '^' || c == '$') {
+      pos++;
+      f.start = addNode(c == '^' ? START : END);
+      f.dangling.assign(1, make_pair(f.start, 0));
+      return true;
+    } else if (c == '[') {
+      pos++;
+      if (!parseClass(set)) {
+	return false;
+      }
+    } else if (c == '.') {
+      pos++;
+      set.add('\n');
+      set.add('\r');
+      set.invert();
+    } else if (c == '\\') {
+      pos++;
+      if (!parseEscape(set)) {
+	return false;
+      }
+    } else {
+      pos++;
+      set.add((unsigned char) c);
+    }
+    f.start = addNode(CHARS);
+    nodes[f.start].chars = set;
+    f.dangling.assign(1, make_pair(f.start, 0));
+    return true;
+  }
+
+  // parseEscape reads what follows a backslash into `set`.
+  bool parseEscape(ByteSet& set) {
+    if (atEnd()) {
+      return fail("trailing \\");
+    }
+    char c = pattern[pos++];
+    switch (c) {
+    case 'd': case 'D':
+      set.addRange('0', '9');
+      break;
+    case 'w': case 'W':
+      set.addRange('a', 'z');
+      set.addRange('A', 'Z');
+      set.addRange('0', '9');
+      set.add('_');
+      break;
+    case 's': case 'S':
+      set.add(' ');
+      set.addRange('\t', '\r');
+      break;
+    case 'n': set.add('\n'); break;
+    case 't': set.add('\t'); break;
+    case 'r': set.add('\r'); break;
+    case 'f': set.add('\f'); break;
+    case 'v': set.add('\v'); break;
+    case '0': set.add(0); break;
+    case 'x': {
+      int value = 0;
+      for (int i=0; i < 2; i++) {
+	if (atEnd() || !isxdigit((unsigned char) pattern[pos])) {
+	  return fail("\\x needs two hex digits");
+	}
+	char h = pattern[pos++];
+	value = value * 16 + (isdigit((unsigned char) h) ? h - '0' : (tolower(h) - 'a' + 10));
+      }
+      set.add(value);
+      break;
+    }
+    default:
+      // like std::regex, only punctuation escapes to itself. Letters
+      // and digits are escapes this parser doesn't know, like \b or
+      // \1, and must not quietly turn into literals.
+      if (isalnum((unsigned char) c)) {
+	pos--;
+	return fail(string("unsupported escape \\") + c);
+      }
+      set.add((unsigned char) c);
+    }
+    if (c == 'D' || c == 'W' || c == 'S') {
+      set.invert();
+    }
+    return true;
+  }
+
+  // parseClass reads a bracketed class, after the '['.
+  bool parseClass(ByteSet& set) {
+    bool negate = false;
+    if (!atEnd() && pattern[pos] == '^') {
+      negate = true;
+      pos++;
+    }
+    bool first = true;
+    while (true) {
+      if (atEnd()) {
+	return fail("missing ]");
+      }
+      char c = pattern[pos];
+      if (c == ']' && !first) {
+	pos++;
+	break;
+      }
+      first = false;
+      pos++;
+      int lo;
+      if (c == '\\') {
+	ByteSet escaped;
+	char e = atEnd() ? '\0' : pattern[pos];
+	if (!parseEscape(escaped)) {
+	  return false;
+	}
+	if (e == 'd' || e == 'w' || e == 's' || e == 'D' || e == 'W' || e == 'S') {
+	  set.addAll(escaped);
+	  continue;
+	}
+	lo = -1;
+	for (int b=0; b < 256 && lo < 0; b++) {
+	  if (escaped.has(b)) {
+	    lo = b;
+	  }
+	}
+      } else {
+	lo = (unsigned char) c;
+      }
+      if (pos + 1 < pattern.size() && pattern[pos] == '-' && pattern[pos + 1] != ']') {
+	pos++;
+	int hi;
+	if (pattern[pos] == '\\') {
+	  pos++;
+	  ByteSet escaped;
+	  if (!parseEscape(escaped)) {
+	    return false;
+	  }
+	  hi = -1;
+	  for (int b=0; b < 256 && hi < 0; b++) {
+	    if (escaped.has(b)) {
+	      hi = b;
+	    }
+	  }
+	} else {
+	  hi = (unsigned char) pattern[pos++];
+	}
+	if (hi < lo) {
+	  return fail("bad range in []");
+	}
+	set.addRange(lo, hi);
+      } else {
+	set.add(lo);
+      }
+    }
+    if (negate) {
+      set.invert();
+    }
+    return true;
+  }
+};
+
+// closure replaces `ids` with every CHARS and MATCH node reachable
+// from them without consuming input, sorted. START nodes are only
+// passed if `at_start` is set, and END nodes only if `at_end` is set;
+// otherwise the END nodes reached are kept in `ids`, since the input
+// might end there. `stamp` must have one entry per node and is used
+// to avoid revisits.
+void closure(const vector<Node>& nodes, vector<int>& ids, bool at_start,
+	     bool at_end, vector<int>& stamp, int& generation,
+	     vector<int>& stack) {
+  generation++;
+  stack.assign(ids.begin(), ids.end());
+  ids.clear();
+  while (!stack.empty()) {
+    int n = stack.back();
+    stack.pop_back();
+    if (n < 0 || stamp[n] == generation) {
+      continue;
+    }
+    stamp[n] = generation;
+    const Node& node = nodes[n];
+    if (node.type == SPLIT) {
+      stack.push_back(node.out2);
+      stack.push_back(node.out);
+    } else if (node.type == EMPTY ||
+	       (node.type == START && at_start) ||
+	       (node.type == END && at_end)) {
+      stack.push_back(node.out);
+    } else if (node.type == START) {
+      continue;
+    } else {
+      ids.push_back(n);
+    }
+  }
+  sort(ids.begin(), ids.end());
+}
+
+string byteLabel(int b) {
+  if (b > 32 && b < 127) {
+    return string(1, (char) b);
+  }
+  const char* hex = "0123456789abcdef";
+  return string("\\x") + hex[b >> 4] + hex[b & 15];
+}
+
+} // namespace
+
+Regex::Regex() {
+}
+
+bool Regex::compile(string_view pattern) {
+  fsm = FSM();
+  machine = CompiledFSM();
+  error.clear();
+
+  // 1. Thompson's construction.
+  vector<Node> nodes;
+  Parser parser(pattern, nodes, error);
+  Frag whole;
+  if (!parser.parseAlt(whole)) {
+    return false;
+  }
+  if (!parser.atEnd()) {
+    parser.fail("unmatched )");
+    return false;
+  }
+  int match = parser.addNode(MATCH);
+  parser.patch(whole.dangling, match);
+  int start = whole.start;
+
+  // 2. bytes that every CHARS node treats alike share a class, and
+  // the subset construction only steps once per class.
+  vector<int> byte_class(256, 0);
+  int num_classes = 1;
+  for (size_t n=0; n < nodes.size(); n++) {
+    if (nodes[n].type != CHARS) {
+      continue;
+    }
+    vector<int> split(num_classes * 2, -1);
+    int next = 0;
+    for (int b=0; b < 256; b++) {
+      int key = byte_class[b] * 2 + (nodes[n].chars.has(b) ? 1 : 0);
+      if (split[key] < 0) {
+	split[key] = next++;
+      }
+      byte_class[b] = split[key];
+    }
+    num_classes = next;
+  }
+  vector<int> rep(num_classes, -1);
+  for (int b=0; b < 256; b++) {
+    if (rep[byte_class[b]] < 0) {
+      rep[byte_class[b]] = b;
+    }
+  }
+
+  // 3. the subset construction. The start node is added back in
+  // after every byte, so a match may begin anywhere, and `^` only
+  // lets it through before the first byte. Once MATCH is reached the
+  // input contains a match whatever follows, so every such set
+  // becomes one absorbing accepting state. Any other set accepts if
+  // the input ending there lets it through its `$`s to MATCH. The
+  // first set is kept apart from the rest, since `^` holds there.
+  vector<int> stamp(nodes.size(), 0);
+  int generation = 0;
+  vector<int> stack;
+  FSM dfa;
+  vector<vector<int> > sets;
+  unordered_map<string, int> ids;
+  int matched = -1;
+  vector<int> at_end;
+  auto intern = [&](vector<int>& set, bool first) -> int {
+    closure(nodes, set, first, false, stamp, generation, stack);
+    if (binary_search(set.begin(), set.end(), match)) {
+      if (matched < 0) {
+	matched = dfa.addState("match", true);
+	sets.push_back(vector<int>());
+      }
+      return matched;
+    }
+    at_end = set;
+    closure(nodes, at_end, first, true, stamp, generation, stack);
+    bool has_match = binary_search(at_end.begin(), at_end.end(), match);
+    string key((const char*) set.data(), set.size() * sizeof(int));
+    if (first) {
+      key += "^";
+    }
+    unordered_map<string, int>::iterator it = ids.find(key);
+    if (it != ids.end()) {
+      return it->second;
+    }
+    string label = set.empty() ? "no match" : "{";
+    for (size_t i=0; i < set.size(); i++) {
+      label += (i > 0 ? "," : "") + to_string(set[i]);
+    }
+    if (!set.empty()) {
+      label += "}";
+    }
+    int id = dfa.addState(label, has_match);
+    ids[key] = id;
+    sets.push_back(set);
+    return id;
+  };
+  vector<int> first(1, start);
+  intern(first, true);
+
+  vector<int> target(num_classes);
+  vector<int> next;
+  for (size_t d=0; d < sets.size(); d++) {
+    if ((int) d == matched) {
+      continue;
+    }
+    for (int c=0; c < num_classes; c++) {
+      next.clear();
+      for (size_t i=0; i < sets[d].size(); i++) {
+	const Node& node = nodes[sets[d][i]];
+	if (node.type == CHARS && node.chars.has(rep[c])) {
+	  next.push_back(node.out);
+	}
+      }
+      next.push_back(start);
+      target[c] = intern(next, false);
+    }
+    // byte 0xFF reads as FAILURE_SIGNAL through (int) c, so it can
+    // only ever take the failure transition. Its target becomes the
+    // failure target and every byte that goes elsewhere gets its own
+    // transition.
+    int fail = target[byte_class[255]];
+    for (int b=0; b < 255; b++) {
+      if (target[byte_class[b]] != fail) {
+	dfa.addTransition((int) d, target[byte_class[b]], (int) (char) b, byteLabel(b));
+      }
+    }
+    dfa.addTransition((int) d, fail, FAILURE_SIGNAL, "other");
+  }
+
+  // 4. minimize and compile.
+  fsm = dfa.minimize(NULL);
+  machine = fsm.compile();
+  return true;
+}
+
+FSM& Regex::getFSM() {
+  return fsm;
+}
+
+const CompiledFSM& Regex::getMachine() const {
+  return machine;
+}
+
+string Regex::getError() const {
+  return error;
+}
@@ -0,0 +1,78 @@
+//
+// fsm_regex.hpp
+//
+// A regular expression front end that compiles patterns into FSMs.
+//
+
+#ifndef __fsm_regex_h__
+#define __fsm_regex_h__
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "fsm.hpp"
+
+using namespace std;
+
+// Regex compiles a regular expression into a minimized, compiled FSM
+// that answers "does this line contain a match?" with one table load
+// per byte.
+//
+// The supported syntax is:
+//   -- literal characters, and `\` to escape any special one
+//   -- `.` for any byte except \n and \r
+//   -- character classes like [abc], [a-z0-9] and [^"], and the
+//      escapes \d \w \s \D \W \S, which also work inside classes
+//   -- \n \t \r \f \v \0 and \xHH for single bytes
+//   -- concatenation, `|` alternation and `( )` grouping
+//   -- the `*`, `+` and `?` repetition operators
+//   -- `^` and `$`, which only match at the start and end of the
+//      input, anywhere in the pattern, so `^a|b$` is `(^a)|(b$)`
+//
+// Anything else std::regex would read differently, like `{n,m}`
+// repetition or escapes such as \b and \1, is rejected rather than
+// taken literally.
+//
+// The pattern is turned into an NFA by Thompson's construction,
+// determinized by the subset construction over byte classes, and
+// reduced with FSM::minimize. The machine looks for a match starting
+// anywhere, and stops caring about the rest of the input once
+// something has matched, by entering an accepting state with no way
+// out.
+class Regex {
+private:
+  FSM fsm; // the minimized DFA
+
+  CompiledFSM machine; // fsm, compiled for searching
+
+  string error; // why the last compile failed, if it did
+
+public:
+
+  // Regex constructs a regex that matches nothing until compile is
+  // called.
+  Regex();
+
+  // compile parses the pattern and builds its machine. It returns
+  // false, leaving a message in getError(), if the pattern is not
+  // valid. A failed compile leaves a regex that matches nothing.
+  bool compile(string_view pattern);
+
+  // search returns true if the text contains a match.
+  bool search(string_view text) const {
+    return machine.isAcceptState(machine.run(machine.getDefaultState(), text));
+  }
+
+  // getFSM returns the minimized FSM the pattern compiled to. It uses
+  // (int) c for each byte c, like FSM::handleSignals does.
+  FSM& getFSM();
+
+  // getMachine returns the compiled form of getFSM().
+  const CompiledFSM& getMachine() const;
+
+  // getError returns the reason the last compile failed, or an empty
+  // string if it succeeded.
+  string getError() const;
+};
+
+#endif
@@ -0,0 +1,362 @@
+//
+// fsm_scan.cpp
+//
+
+#include "fsm_scan.hpp"
+#include <algorithm>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+// machines with more states than this would need a table of more
+// than 4 GB.
+const int max_scan_states = 1 << 22;
+
+// stream reads go through a buffer of this size.
+const size_t read_size = 1 << 20;
+
+// mapped files are scanned this much at a time, and each piece is
+// dropped from memory once it has been scanned, so a huge file
+// doesn't fill up the process's resident set.
+const size_t map_window = 64 << 20;
+
+// parallel scans give each thread at least this many bytes.
+const size_t min_parallel_chunk = 1 << 16;
+
+// machines with at most this many states run every chunk from every
+// state; larger ones guess.
+const int max_enumerated_states = 256;
+
+// bytes run before a chunk to guess the state it starts in.
+const size_t speculation_lookback = 1024;
+
+// candidates are merged every this many bytes.
+const size_t merge_interval = 32;
+
+// a chunk gives up on candidates that haven't merged down to
+// max_unmerged after max_merge_bytes.
+const size_t max_merge_bytes = 1 << 14;
+const size_t max_unmerged = 8;
+
+// ChunkScan is what the first pass of a parallel scan learns about
+// one chunk.
+struct ChunkScan {
+  size_t begin; // the chunk is [begin, end) of the input
+  size_t end;
+
+  vector<int> from;   // candidate start states, sorted
+  vector<uint32_t> to; // entry each candidate ends in
+
+  size_t merged; // bytes into the chunk where every candidate had
+		 // reached the same state, or the chunk's size
+
+  bool abandoned; // the candidates didn't merge; from and to are empty
+
+  uint32_t start; // the real start entry, found by chaining
+
+  vector<uint64_t> head; // matches before `merged`
+  vector<uint64_t> tail; // matches from `merged` on
+};
+
+// scanRange runs the table over n bytes from entry e, appends the
+// end offset of every match, counting the first byte as `base`, and
+// returns the entry it ends in.
+uint32_t scanRange(const uint32_t* t, const unsigned char* p, size_t n,
+		   uint32_t e, uint64_t base, vector<uint64_t>& matches) {
+  for (size_t i=0; i < n; i++) {
+    e = t[(e & ~(uint32_t) 0xFF) | p[i]];
+    if (e & 1) {
+      matches.push_back(base + i + 1);
+    }
+  }
+  return e;
+}
+
+// speculate runs one chunk from all of its candidate start states
+// together, merging the ones that meet, and fills in `to`, `merged`
+// and `tail`.
+void speculate(const uint32_t* t, const unsigned char* p, uint64_t base,
+	       ChunkScan& c) {
+  size_t n = c.end - c.begin;
+  vector<uint32_t> cur(c.from.size()); // distinct entries still running
+  vector<size_t> group(c.from.size()); // cur index of each candidate
+  for (size_t j=0; j < cur.size(); j++) {
+    cur[j] = (uint32_t) c.from[j] << 8;
+    group[j] = j;
+  }
+  vector<uint32_t> distinct;
+  size_t i = 0;
+  while (cur.size() > 1 && i < n) {
+    size_t stop = min(n, i + merge_interval);
+    for (; i < stop; i++) {
+      uint32_t b = p[i];
+      for (size_t j=0; j < cur.size(); j++) {
+	cur[j] = t[(cur[j] & ~(uint32_t) 0xFF) | b];
+      }
+    }
+    // candidates in the same state run the same from here on, even if
+    // only one of them just entered it.
+    for (size_t j=0; j < cur.size(); j++) {
+      cur[j] &= ~(uint32_t) 0xFF;
+    }
+    distinct = cur;
+    sort(distinct.begin(), distinct.end());
+    distinct.erase(unique(distinct.begin(), distinct.end()), distinct.end());
+    if (distinct.size() < cur.size()) {
+      for (size_t j=0; j < group.size(); j++) {
+	group[j] = lower_bound(distinct.begin(), distinct.end(), cur[group[j]]) -
+	  distinct.begin();
+      }
+      cur.swap(distinct);
+    }
+    if (cur.size() > max_unmerged && i >= max_merge_bytes) {
+      c.abandoned = true;
+      c.from.clear();
+      return;
+    }
+  }
+  c.merged = cur.size() == 1 ? i : n;
+  if (cur.size() == 1) {
+    cur[0] = scanRange(t, p + i, n - i, cur[0], base + i, c.tail);
+  }
+  c.to.resize(c.from.size());
+  for (size_t j=0; j < group.size(); j++) {
+    c.to[j] = cur[group[j]];
+  }
+}
+
+} // namespace
+
+Scanner::Scanner() {
+  start = 0;
+  entry = 0;
+  offset = 0;
+}
+
+bool Scanner::load(const CompiledFSM& machine) {
+  table.clear();
+  error.clear();
+  int n = machine.countStates();
+  if (n == 0) {
+    error = "machine has no states";
+    reset();
+    return false;
+  }
+  if (n > max_scan_states) {
+    error = "machine has too many states to scan";
+    reset();
+    return false;
+  }
+  table.resize((size_t) n * 256);
+  for (int s=0; s < n; s++) {
+    uint32_t* row = &table[(size_t) s * 256];
+    bool was_accepting = machine.isAcceptState(s);
+    int nexts[256]; // -1 where the byte has no transition
+    bool absorbing = true; // every byte leads back to s
+    for (int b=0; b < 256; b++) {
+      nexts[b] = machine.nextState(s, (int) (char) b);
+      absorbing = absorbing && (nexts[b] < 0 || nexts[b] == s);
+    }
+    // a transition back into the same accept state is another match,
+    // like keyword "a" again in "aa", unless the state can never be
+    // left, as after a Regex match.
+    for (int b=0; b < 256; b++) {
+      int next = nexts[b] < 0 ? s : nexts[b];
+      bool enters = machine.isAcceptState(next) &&
+	(!was_accepting || next != s || (nexts[b] >= 0 && !absorbing));
+      row[b] = (uint32_t) next << 8 | enters;
+    }
+  }
+  start = (uint32_t) machine.getDefaultState() << 8;
+  reset();
+  return true;
+}
+
+void Scanner::reset() {
+  entry = start;
+  offset = 0;
+}
+
+int Scanner::getState() const {
+  return table.empty() ? -1 : (int) (entry >> 8);
+}
+
+uint64_t Scanner::getOffset() const {
+  return offset;
+}
+
+void Scanner::scan(string_view chunk, vector<uint64_t>& matches) {
+  scan(chunk, [&](uint64_t end, int) {
+    matches.push_back(end);
+  });
+}
+
+void Scanner::scanParallel(string_view input, vector<uint64_t>& matches,
+			   int threads) {
+  if (threads <= 0) {
+    threads = (int) thread::hardware_concurrency();
+  }
+  size_t num_chunks = min((size_t) max(threads, 1), input.size() / min_parallel_chunk);
+  if (table.empty() || num_chunks < 2) {
+    scan(input, matches);
+    return;
+  }
+  const uint32_t* t = table.data();
+  const unsigned char* p = (const unsigned char*) input.data();
+  int num_states = (int) (table.size() / 256);
+
+  vector<ChunkScan> chunks(num_chunks);
+  for (size_t i=0; i < num_chunks; i++) {
+    chunks[i].begin = input.size() * i / num_chunks;
+    chunks[i].end = input.size() * (i + 1) / num_chunks;
+    chunks[i].abandoned = false;
+  }
+  // the first chunk's start state is known.
+  chunks[0].from.push_back((int) (entry >> 8));
+
+  auto first_pass = [&](size_t i) {
+    ChunkScan& c = chunks[i];
+    if (i > 0 && num_states <= max_enumerated_states) {
+      for (int s=0; s < num_states; s++) {
+	c.from.push_back(s);
+      }
+    } else if (i > 0) {
+      size_t back = min(c.begin, speculation_lookback);
+      uint32_t e = start;
+      for (size_t k=c.begin - back; k < c.begin; k++) {
+	e = t[(e & ~(uint32_t) 0xFF) | p[k]];
+      }
+      c.from.push_back((int) (start >> 8));
+      c.from.push_back((int) (e >> 8));
+      sort(c.from.begin(), c.from.end());
+      c.from.erase(unique(c.from.begin(), c.from.end()), c.from.end());
+    }
+    speculate(t, p + c.begin, offset + c.begin, c);
+  };
+  vector<thread> workers;
+  for (size_t i=1; i < num_chunks; i++) {
+    workers.push_back(thread(first_pass, i));
+  }
+  first_pass(0);
+  for (size_t i=0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+  workers.clear();
+
+  // chain the maps from the real start state. A chunk that can't be
+  // chained is scanned again here, from its real start.
+  uint32_t e = entry;
+  for (size_t i=0; i < num_chunks; i++) {
+    ChunkScan& c = chunks[i];
+    c.start = e;
+    vector<int>::iterator it = lower_bound(c.from.begin(), c.from.end(), (int) (e >> 8));
+    if (it != c.from.end() && *it == (int) (e >> 8)) {
+      e = c.to[it - c.from.begin()];
+    } else {
+      c.merged = 0;
+      c.tail.clear();
+      e = scanRange(t, p + c.begin, c.end - c.begin, e, offset + c.begin, c.tail);
+    }
+  }
+
+  // the bytes before each chunk's merge point are scanned again now
+  // that the chunk's real start is known.
+  auto second_pass = [&](size_t i) {
+    ChunkScan& c = chunks[i];
+    scanRange(t, p + c.begin, c.merged, c.start, offset + c.begin, c.head);
+  };
+  for (size_t i=1; i < num_chunks; i++) {
+    if (chunks[i].merged > 0) {
+      workers.push_back(thread(second_pass, i));
+    }
+  }
+  second_pass(0);
+  for (size_t i=0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+
+  for (size_t i=0; i < num_chunks; i++) {
+    matches.insert(matches.end(), chunks[i].head.begin(), chunks[i].head.end());
+    matches.insert(matches.end(), chunks[i].tail.begin(), chunks[i].tail.end());
+  }
+  entry = e;
+  offset += input.size();
+}
+
+bool Scanner::scanFile(const string& path, vector<uint64_t>& matches) {
+  return scanFile(path, [&](uint64_t end, int) {
+    matches.push_back(end);
+  });
+}
+
+string Scanner::getError() const {
+  return error;
+}
+
+bool Scanner::forEachChunk(const string& path, int fd,
+			   const function<void(string_view)>& chunk) {
+  error.clear();
+  bool opened = false;
+  if (!path.empty()) {
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      error = "can't open " + path;
+      return false;
+    }
+    opened = true;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      size_t size = (size_t) st.st_size;
+      if (size == 0) {
+	close(fd);
+	return true;
+      }
+      void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+	close(fd);
+	madvise(p, size, MADV_SEQUENTIAL);
+	const char* base = (const char*) p;
+	for (size_t at=0; at < size; at += map_window) {
+	  size_t len = size - at < map_window ? size - at : map_window;
+	  chunk(string_view(base + at, len));
+	  madvise((void*) (base + at), len, MADV_DONTNEED);
+	}
+	munmap(p, size);
+	return true;
+      }
+      // not mappable; read it instead.
+    }
+  }
+
+  if (buffer.size() != read_size) {
+    buffer.resize(read_size);
+  }
+  bool ok = true;
+  for (;;) {
+    ssize_t got = read(fd, buffer.data(), buffer.size());
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0) {
+      error = "can't read " + (path.empty() ? "stream" : path);
+      ok = false;
+      break;
+    }
+    if (got == 0) {
+      break;
+    }
+    chunk(string_view(buffer.data(), (size_t) got));
+  }
+  if (opened) {
+    close(fd);
+  }
+  return ok;
+}
@@ -0,0 +1,165 @@
+//
+// fsm_scan.hpp
+//
+// A scanner that runs a machine over files and streams and reports
+// where it matched.
+//
+
+#ifndef __fsm_scan_h__
+#define __fsm_scan_h__
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "fsm.hpp"
+
+using namespace std;
+
+// Scanner runs a compiled machine over char input that arrives in
+// pieces, like a memory-mapped file or a pipe, and reports every
+// offset at which the machine enters an accept state: the offset just
+// past each byte whose transition leads to an accept state, counted
+// from the start of the scan. That includes moving from one accept
+// state to another and taking a transition from an accept state back
+// to itself, so an Aho-Corasick machine reports the end of every
+// keyword occurrence, adjacent ones included. Two steps are not
+// reported, because they don't enter anything: a byte with no
+// transition, which leaves the machine where it was, and any byte in
+// an accept state that no byte ever leaves, like the one a Regex
+// reaches on a match, which would otherwise report every byte after
+// the match. The state and the offset carry from one chunk to the
+// next, so splitting the input differently never changes the
+// matches.
+//
+// The machine is copied into a dense table with a row of 256 entries
+// per state, each holding the next state already resolved (a byte
+// with no transition leads back to the same state) and whether the
+// step enters an accept state. Scanning a byte is then one load and
+// one test, with no class lookup. The table costs 1 KB per state.
+//
+// Matches go to a callback, called as on_match(end, state) with the
+// end offset and the accept state reached, or are appended to a
+// vector.
+class Scanner {
+private:
+  vector<uint32_t> table; // next state << 8 | 1 if it enters an accept
+			  // state, for each state and byte
+
+  uint32_t start; // the default state's entry. Entries for the
+		  // current state only use the state bits.
+
+  uint32_t entry; // the current state's entry
+
+  uint64_t offset; // bytes scanned since reset()
+
+  vector<char> buffer; // read buffer for streams
+
+  string error; // why the last file or stream scan failed
+
+  // forEachChunk calls `chunk` on the contents of the file at `path`,
+  // in order, or on what can be read from `fd` if `path` is empty.
+  bool forEachChunk(const string& path, int fd,
+		    const function<void(string_view)>& chunk);
+
+public:
+
+  // Scanner constructs a scanner with no machine, which never
+  // matches.
+  Scanner();
+
+  // load replaces the machine with the given one and resets the
+  // scanner. It returns false, leaving a scanner with no machine and
+  // a message in getError(), if the machine has no states or is too
+  // large for the table.
+  bool load(const CompiledFSM& machine);
+
+  // reset puts the scanner back in the machine's default state at
+  // offset 0.
+  void reset();
+
+  // getState returns the current state, or -1 if there is no machine.
+  int getState() const;
+
+  // getOffset returns the number of bytes scanned since reset().
+  uint64_t getOffset() const;
+
+  // scan feeds the chunk to the machine and calls on_match for every
+  // match that ends in it.
+  template <class Callback>
+  void scan(string_view chunk, Callback&& on_match) {
+    if (table.empty()) {
+      offset += chunk.size();
+      return;
+    }
+    const uint32_t* t = table.data();
+    const unsigned char* p = (const unsigned char*) chunk.data();
+    size_t n = chunk.size();
+    uint32_t e = entry;
+    for (size_t i=0; i < n; i++) {
+      e = t[(e & ~(uint32_t) 0xFF) | p[i]];
+      if (e & 1) {
+	on_match(offset + i + 1, (int) (e >> 8));
+      }
+    }
+    entry = e;
+    offset += n;
+  }
+
+  // scan feeds the chunk to the machine and appends the end offset of
+  // every match in it to `matches`.
+  void scan(string_view chunk, vector<uint64_t>& matches);
+
+  // scanParallel scans the input like scan, with the same matches,
+  // final state and offset, but splits the work across `threads`
+  // threads, or one per core if `threads` is 0. Inputs too small to
+  // be worth splitting are scanned on the calling thread.
+  //
+  // Every chunk but the first is run at once from a set of candidate
+  // start states, merging candidates as soon as they reach the same
+  // state, which for most machines happens within a few bytes. That
+  // gives a map from start state to end state for each chunk, and
+  // chaining the maps from the real start state gives every chunk's
+  // real start state. Matches past the point where a chunk's
+  // candidates merged are known from the first pass; only the bytes
+  // before it are scanned again. The candidates are every state for
+  // small machines, and for large ones the state the machine is in
+  // after the bytes just before the chunk, run from the default
+  // state, plus the default state. A chunk whose real start state
+  // was not a candidate, or whose candidates don't merge, is scanned
+  // again on its own.
+  void scanParallel(string_view input, vector<uint64_t>& matches, int threads = 0);
+
+  // scanFile scans the whole file at `path`, continuing from the
+  // current state, and calls on_match for every match. Regular files
+  // are memory-mapped and never copied; anything else is read in
+  // chunks. It returns false, leaving a message in getError(), if the
+  // file can't be opened or read.
+  template <class Callback>
+  bool scanFile(const string& path, Callback&& on_match) {
+    return forEachChunk(path, -1, [&](string_view chunk) {
+      scan(chunk, on_match);
+    });
+  }
+
+  // scanFile scans the file like the other scanFile and appends the
+  // end offset of every match to `matches`.
+  bool scanFile(const string& path, vector<uint64_t>& matches);
+
+  // scanStream reads `fd` until end of file, continuing from the
+  // current state, and calls on_match for every match. It returns
+  // false, leaving a message in getError(), if a read fails. The
+  // descriptor is not closed.
+  template <class Callback>
+  bool scanStream(int fd, Callback&& on_match) {
+    return forEachChunk("", fd, [&](string_view chunk) {
+      scan(chunk, on_match);
+    });
+  }
+
+  // getError returns the reason the last load, scanFile or scanStream
+  // failed, or an empty string if it succeeded.
+  string getError() const;
+};
+
+#endif
@@ -0,0 +1,192 @@
+//
+// fsm_static.hpp
+//
+// A constexpr FSM that can be built and checked at compile time.
+//
+
+#ifndef __fsm_static_h__
+#define __fsm_static_h__
+
+#include <string_view>
+#include "fsm.hpp"
+
+using namespace std;
+
+// StaticFSM is a fixed-capacity FSM whose whole API is constexpr, so
+// a machine can be built by a constexpr function, stored in a
+// `static constexpr` variable in read-only data, and checked with
+// static_assert. It needs no heap and no startup code, and when the
+// input is known the compiler can fold the transitions away entirely.
+//
+// addState and addTransition mirror FSM's: the same IDs, the same
+// duplicate rules, the same FAILURE_SIGNAL handling, and state 0 is
+// the default state. Running it follows FSM::handleSignal, including
+// the first transition added for a signal winning. Labels must be
+// string literals or otherwise outlive the machine.
+//
+// It offers the same machine interface as CompiledFSM, so Cursors
+// run it too. Lookups scan the state's transitions, which suits the
+// small machines this is meant for.
+template <int MaxStates, int MaxTransitions>
+class StaticFSM {
+private:
+  int num_states = 0;
+  int num_transitions = 0;
+
+  bool accept[MaxStates] = {};
+  const char* labels[MaxStates] = {};
+  int failure[MaxStates] = {}; // failure target of each state, or -1
+
+  int from[MaxTransitions] = {}; // normal and failure transitions,
+  int to[MaxTransitions] = {};   // in the order they were added
+  int signal[MaxTransitions] = {};
+  const char* trans_labels[MaxTransitions] = {};
+
+public:
+
+  // StaticFSM constructs a machine with no states.
+  constexpr StaticFSM() {}
+
+  // addState adds a state and returns its ID, or -1 if the machine is
+  // full. See FSM::addState.
+  constexpr int addState(const char* label, bool is_accept_state) {
+    if (num_states == MaxStates) {
+      return -1;
+    }
+    int id = num_states++;
+    accept[id] = is_accept_state;
+    labels[id] = label;
+    failure[id] = -1;
+    return id;
+  }
+
+  // addState adds a non-accepting state. See the other addState.
+  constexpr int addState(const char* label) {
+    return addState(label, false);
+  }
+
+  // addTransition adds a transition and returns its ID. It returns -1
+  // if either state doesn't exist, if the transition is a duplicate,
+  // or if the machine is full. See FSM::addTransition.
+  constexpr int addTransition(int stateA, int stateB, int sig,
+			      const char* label) {
+    if (stateA < 0 || stateA >= num_states ||
+	stateB < 0 || stateB >= num_states ||
+	num_transitions == MaxTransitions) {
+      return -1;
+    }
+    if (sig == FAILURE_SIGNAL) {
+      if (failure[stateA] == stateB) {
+	return -1;
+      }
+      failure[stateA] = stateB;
+    } else {
+      for (int t=0; t < num_transitions; t++) {
+	if (from[t] == stateA && to[t] == stateB && signal[t] == sig) {
+	  return -1;
+	}
+      }
+    }
+    int id = num_transitions++;
+    from[id] = stateA;
+    to[id] = stateB;
+    signal[id] = sig;
+    trans_labels[id] = label;
+    return id;
+  }
+
+  // countStates returns the number of states.
+  constexpr int countStates() const {
+    return num_states;
+  }
+
+  // countTransitions returns the number of transitions.
+  constexpr int countTransitions() const {
+    return num_transitions;
+  }
+
+  // getDefaultState returns 0, or -1 if there are no states.
+  constexpr int getDefaultState() const {
+    return num_states > 0 ? 0 : -1;
+  }
+
+  // getLabel returns the label of the given state, or an empty view
+  // for out of range ids.
+  constexpr string_view getLabel(int id) const {
+    if (id < 0 || id >= num_states || labels[id] == NULL) {
+      return string_view();
+    }
+    return string_view(labels[id]);
+  }
+
+  // isAcceptState returns true if the given state is an accepting
+  // state. Out of range ids return false.
+  constexpr bool isAcceptState(int id) const {
+    return id >= 0 && id < num_states && accept[id];
+  }
+
+  // nextState returns the state reached from the given state on the
+  // given signal, or -1 if FSM::handleSignal would not take a
+  // transition. The state id must be valid.
+  constexpr int nextState(int id, int sig) const {
+    if (sig != FAILURE_SIGNAL) {
+      for (int t=0; t < num_transitions; t++) {
+	if (from[t] == id && signal[t] == sig) {
+	  return to[t];
+	}
+      }
+    }
+    return failure[id];
+  }
+
+  // run feeds every signal in [begin, end) to the machine starting in
+  // the given state and returns the state it ends in. Signals with no
+  // transition leave the state unchanged. An invalid start state is
+  // returned as is.
+  constexpr int run(int id, const int* begin, const int* end) const {
+    if (id < 0 || id >= num_states) {
+      return id;
+    }
+    for (const int* p=begin; p != end; ++p) {
+      int next = nextState(id, *p);
+      id = next < 0 ? id : next;
+    }
+    return id;
+  }
+
+  // run feeds each character of the input to the machine, using
+  // (int) c as the signal. See the other run function for the rest.
+  constexpr int run(int id, string_view input) const {
+    if (id < 0 || id >= num_states) {
+      return id;
+    }
+    for (size_t i=0; i < input.size(); i++) {
+      int next = nextState(id, (int) input[i]);
+      id = next < 0 ? id : next;
+    }
+    return id;
+  }
+
+  // accepts returns true if the input, fed from the default state,
+  // ends in an accept state.
+  constexpr bool accepts(string_view input) const {
+    return isAcceptState(run(getDefaultState(), input));
+  }
+
+  // toFSM builds an ordinary FSM with the same states and
+  // transitions, in the same order and with the same IDs.
+  FSM toFSM() const {
+    FSM fsm;
+    fsm.reserve(num_states, num_transitions);
+    for (int s=0; s < num_states; s++) {
+      fsm.addState(labels[s] == NULL ? "" : labels[s], accept[s]);
+    }
+    for (int t=0; t < num_transitions; t++) {
+      fsm.addTransition(from[t], to[t], signal[t],
+			trans_labels[t] == NULL ? "" : trans_labels[t]);
+    }
+    return fsm;
+  }
+};
+
+#endif
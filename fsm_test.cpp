@@ -10,8 +10,24 @@
 // C++ spec, and therefore might not work with all compilers.
 
 #include "catch.hpp"
+#include <regex>
+#include <dlfcn.h>
+#include <thread>
+#include <sstream>
+#include <unistd.h>
+#include <fcntl.h>
 #define private public
 #include "fsm.hpp"
+#include "fsm_regex.hpp"
+#include "fsm_dict.hpp"
+#include "fsm_image.hpp"
+#include "fsm_text.hpp"
+#include "fsm_codegen.hpp"
+#include "fsm_static.hpp"
+#include "fsm_jit.hpp"
+#include "fsm_trace.hpp"
+#include "fsm_scan.hpp"
+#include "fsm_batch.hpp"
 
 using namespace std;
 
@@ -19,7 +35,9 @@ using namespace std;
 FSM fsm_simple();
 FSM fsm_moonman();
 FSM fsm_brain_bag();
+FSM fsm_random(int num_states, int num_signals, int fanout, unsigned seed);
 void recognize(FSM& fsm, string input, bool exp, bool is_bogus);
+void same_behavior(FSM& a, FSM& b, int num_signals, unsigned seed);
 
 
 // Unit Tests
@@ -234,6 +252,1685 @@ TEST_CASE("FSM: brain bag", "[brain bag]") {
   recognize(brain_bag, "BUS", false, true);
 }
 
+TEST_CASE("FSM: compiled table", "[compile]") {
+  // the compiled table has to make the same decisions as the
+  // uncompiled FSM for every state and every signal, including
+  // signals that only the failure transitions handle.
+  FSM brain_bag = fsm_brain_bag();
+  CompiledFSM c = brain_bag.compile();
+  REQUIRE(c.countStates() == brain_bag.countStates());
+  REQUIRE(c.getDefaultState() == brain_bag.getDefaultState());
+  for (int s=0; s < brain_bag.countStates(); s++) {
+    REQUIRE(c.isAcceptState(s) == brain_bag.getState(s)->accept);
+    for (int sig=-2; sig < 130; sig++) {
+      brain_bag.setState(s);
+      bool went = brain_bag.handleSignal(sig);
+      int next = c.nextState(s, sig);
+      REQUIRE(went == (next >= 0));
+      if (went) {
+	REQUIRE(next == brain_bag.getCurrentState());
+      }
+    }
+  }
+  REQUIRE_FALSE(c.isAcceptState(-1));
+  REQUIRE_FALSE(c.isAcceptState(c.countStates()));
+
+  // a frozen FSM runs from the table until it is edited again.
+  brain_bag.freeze();
+  REQUIRE(brain_bag.isFrozen());
+  recognize(brain_bag, "MONKEY", false, true);
+  recognize(brain_bag, "BRAINS", true, false);
+  recognize(brain_bag, "BAA", false, true);
+  brain_bag.addState("Unused");
+  REQUIRE_FALSE(brain_bag.isFrozen());
+  recognize(brain_bag, "BINS", true, false);
+
+  // machines without failure transitions stay put on unknown signals.
+  FSM simple = fsm_simple();
+  simple.freeze();
+  REQUIRE(simple.handleSignal(0));
+  REQUIRE_FALSE(simple.isAcceptState());
+  REQUIRE_FALSE(simple.handleSignal(42));
+  REQUIRE_FALSE(simple.isAcceptState());
+
+  FSM empty;
+  empty.freeze();
+  REQUIRE_FALSE(empty.handleSignal(0));
+}
+
+TEST_CASE("FSM: signal classes", "[compile]") {
+  // brain bag only cares about a handful of letters, and every other
+  // signal goes down the failure transitions in class 0.
+  FSM brain_bag = fsm_brain_bag();
+  SignalMap m = brain_bag.signalClasses();
+  REQUIRE(m.classOf((int) 'Q') == 0);
+  REQUIRE(m.classOf(-7) == 0);
+  REQUIRE(m.classOf(100000) == 0);
+  REQUIRE(m.classOf((int) 'B') != 0);
+  REQUIRE(m.classOf((int) 'B') != m.classOf((int) 'A'));
+  REQUIRE(m.countClasses() <= 8);
+  REQUIRE(brain_bag.compile().countClasses() == m.countClasses());
+
+  // 'x' and 'y' always lead to the same place, 'z' doesn't, and the
+  // large and negative signals need the sparse table.
+  FSM fsm;
+  int a = fsm.addState("A", true);
+  int b = fsm.addState("B");
+  fsm.addTransition(a, b, (int) 'x', "x");
+  fsm.addTransition(a, b, (int) 'y', "y");
+  fsm.addTransition(a, b, 70000, "big");
+  fsm.addTransition(b, a, (int) 'y', "y");
+  fsm.addTransition(b, a, (int) 'x', "x");
+  fsm.addTransition(b, a, 70000, "big");
+  fsm.addTransition(b, b, (int) 'z', "z");
+  fsm.addTransition(a, a, -5, "neg");
+  m = fsm.signalClasses();
+  REQUIRE(m.classOf((int) 'x') == m.classOf((int) 'y'));
+  REQUIRE(m.classOf((int) 'x') == m.classOf(70000));
+  REQUIRE(m.classOf((int) 'z') != m.classOf((int) 'x'));
+  REQUIRE(m.classOf(-5) != 0);
+  REQUIRE(m.countClasses() == 4);
+  for (int c=1; c < m.countClasses(); c++) {
+    REQUIRE(m.classOf(m.getRepresentative(c)) == c);
+  }
+  CompiledFSM c = fsm.compile();
+  REQUIRE(c.nextState(a, 70000) == b);
+  REQUIRE(c.nextState(b, 70000) == a);
+  REQUIRE(c.nextState(a, -5) == a);
+  REQUIRE(c.nextState(b, -5) == -1);
+  REQUIRE(c.nextState(a, (int) 'z') == -1);
+}
+
+TEST_CASE("FSM: batch signals", "[batch]") {
+  // running a buffer in one call has to end in the same state as
+  // calling handleSignal on every signal, frozen or not.
+  const char* inputs[] = { "MONKEY", "BIN", "BINS", "BA", "BAA", "BRAIN",
+			   "BRAINS", "BUS", "", "BR\xe9", "BAGGAGE" };
+  for (size_t i=0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    string input = inputs[i];
+    FSM slow = fsm_brain_bag();
+    for (size_t j=0; j < input.size(); j++) {
+      slow.handleSignal((int) input[j]);
+    }
+    vector<int> sigs;
+    for (size_t j=0; j < input.size(); j++) {
+      sigs.push_back((int) input[j]);
+    }
+
+    FSM fast = fsm_brain_bag();
+    REQUIRE(fast.handleSignals(input) == slow.isAcceptState());
+    REQUIRE(fast.getCurrentState() == slow.getCurrentState());
+    fast.setState(fast.getDefaultState());
+    fast.freeze();
+    REQUIRE(fast.handleSignals(input) == slow.isAcceptState());
+    REQUIRE(fast.getCurrentState() == slow.getCurrentState());
+    fast.setState(fast.getDefaultState());
+    REQUIRE(fast.handleSignals(sigs.data(), sigs.data() + sigs.size()) ==
+	    slow.isAcceptState());
+    REQUIRE(fast.getCurrentState() == slow.getCurrentState());
+  }
+
+  // bad start states pass through untouched.
+  CompiledFSM c = fsm_simple().compile();
+  REQUIRE(c.run(-1, "0101") == -1);
+  REQUIRE(c.run(c.getDefaultState(), string("\0\0\0", 3)) == 1);
+}
+
+TEST_CASE("FSM: cursors", "[cursor]") {
+  // one shared machine, many independent sessions.
+  FSM fsm = fsm_brain_bag();
+  shared_ptr<const CompiledFSM> machine = fsm.share();
+  REQUIRE(fsm.isFrozen());
+  REQUIRE(fsm.share() == machine);
+  REQUIRE(sizeof(Cursor) <= 16);
+
+  vector<Cursor> sessions(3, Cursor(*machine));
+  const char* inputs[] = { "BRAIN", "BAG", "BUS" };
+  bool expect[] = { true, true, false };
+  for (size_t pos=0; pos < 5; pos++) {
+    for (size_t i=0; i < sessions.size(); i++) {
+      string input = inputs[i];
+      if (pos < input.size()) {
+	sessions[i].handleSignal(*machine, (int) input[pos]);
+      }
+    }
+  }
+  for (size_t i=0; i < sessions.size(); i++) {
+    REQUIRE(sessions[i].isAcceptState(*machine) == expect[i]);
+  }
+
+  // the machine outlives edits to the FSM it came from.
+  fsm.addState("Unused");
+  REQUIRE(machine->countStates() == fsm.countStates() - 1);
+
+  // stats count every signal, whichever way it is fed.
+  CompiledFSM simple = fsm_simple().compile();
+  CursorStats stats;
+  Cursor cur(simple, &stats);
+  REQUIRE(cur.handleSignal(simple, 0));
+  REQUIRE_FALSE(cur.handleSignal(simple, 7));
+  int sigs[] = { 0, 1, 1 };
+  REQUIRE(cur.handleSignals(simple, sigs, sigs + 3));
+  REQUIRE(stats.signals == 5);
+  REQUIRE(stats.transitions == 4);
+  REQUIRE(stats.misses == 1);
+  cur.reset(simple);
+  cur.stats = NULL;
+  REQUIRE_FALSE(cur.handleSignals(simple, string("\0", 1)));
+  REQUIRE(stats.signals == 5);
+
+  Cursor none;
+  REQUIRE_FALSE(none.handleSignal(simple, 0));
+  REQUIRE_FALSE(none.isAcceptState(simple));
+}
+
+TEST_CASE("FSM: storage", "[storage]") {
+  // reserved states and transitions come from one contiguous block.
+  FSM fsm;
+  fsm.reserve(100, 200);
+  for (int i=0; i < 100; i++) {
+    fsm.addState("s", i % 2 == 0);
+  }
+  for (int i=0; i < 100; i++) {
+    fsm.addTransition(i, (i + 1) % 100, 1, "next");
+    fsm.addTransition(i, (i + 99) % 100, 2, "prev");
+  }
+  for (int i=1; i < 100; i++) {
+    REQUIRE(fsm.states[i] == fsm.states[0] + i);
+  }
+  for (int i=1; i < 200; i++) {
+    REQUIRE(fsm.transitions[i] == fsm.transitions[0] + i);
+  }
+
+  // copies are deep and keep every ID.
+  FSM copy = fsm;
+  REQUIRE(copy.countStates() == 100);
+  REQUIRE(copy.countTransitions() == 200);
+  REQUIRE(copy.states[0] != fsm.states[0]);
+  copy.addTransition(0, 50, 3, "jump");
+  REQUIRE(copy.countTransitions() == 201);
+  REQUIRE(fsm.countTransitions() == 200);
+  REQUIRE(copy.getState(0)->trans.size() == 3);
+  REQUIRE(fsm.getState(0)->trans.size() == 2);
+  copy.handleSignal(3);
+  REQUIRE(copy.getCurrentState() == 50);
+  REQUIRE(fsm.getCurrentState() == 0);
+
+  // moves leave the source empty.
+  FSM moved = std::move(copy);
+  REQUIRE(moved.countTransitions() == 201);
+  REQUIRE(copy.countStates() == 0);
+  REQUIRE(copy.getCurrentState() == -1);
+  copy = moved;
+  REQUIRE(copy.countStates() == 100);
+  recognize(copy, "", true, false);
+}
+
+TEST_CASE("FSM: packed layout", "[packed]") {
+  // the packed arrays have to make the same decisions as the FSM.
+  FSM brain_bag = fsm_brain_bag();
+  PackedFSM p = brain_bag.pack();
+  REQUIRE(p.countStates() == brain_bag.countStates());
+  REQUIRE(p.getDefaultState() == brain_bag.getDefaultState());
+  for (int s=0; s < brain_bag.countStates(); s++) {
+    REQUIRE(p.isAcceptState(s) == brain_bag.getState(s)->accept);
+    REQUIRE(p.getLabel(s) == brain_bag.getState(s)->label);
+    for (int sig=-2; sig < 130; sig++) {
+      brain_bag.setState(s);
+      bool went = brain_bag.handleSignal(sig);
+      int next = p.nextState(s, sig);
+      REQUIRE(went == (next >= 0));
+      if (went) {
+	REQUIRE(next == brain_bag.getCurrentState());
+      }
+    }
+  }
+  REQUIRE(p.getLabel(-1) == "");
+
+  // the first of several transitions on one signal wins, and the rest
+  // are dropped.
+  FSM fsm;
+  int a = fsm.addState("A");
+  int b = fsm.addState("B", true);
+  int c = fsm.addState("C");
+  fsm.addTransition(a, c, 9, "9");
+  fsm.addTransition(a, b, 5, "5");
+  fsm.addTransition(a, c, 5, "5 again");
+  p = fsm.pack();
+  REQUIRE(p.countTransitions() == 2);
+  REQUIRE(p.nextState(a, 5) == b);
+  REQUIRE(p.nextState(a, 9) == c);
+  REQUIRE(p.nextState(a, 7) == -1);
+
+  // cursors run the same way on packed and compiled machines.
+  FSM bag = fsm_brain_bag();
+  CompiledFSM compiled = bag.compile();
+  PackedFSM packed = bag.pack();
+  Cursor c1(compiled);
+  Cursor c2(packed);
+  REQUIRE(c1.handleSignals(compiled, "BRAINS"));
+  REQUIRE(c2.handleSignals(packed, "BRAINS"));
+  REQUIRE(c1.state == c2.state);
+  REQUIRE(c2.handleSignal(packed, (int) 'Q'));
+  REQUIRE(packed.getLabel(c2.state) == "Bogus State");
+}
+
+TEST_CASE("FSM: transition index", "[add transitions]") {
+  // a dense state with many transitions still rejects duplicates, and
+  // every transition can be found again by its key.
+  FSM fsm;
+  int hub = fsm.addState("hub");
+  for (int i=0; i < 50; i++) {
+    fsm.addState("leaf");
+  }
+  for (int sig=0; sig < 1000; sig++) {
+    int id = fsm.addTransition(hub, 1 + sig % 50, sig, "t");
+    REQUIRE(id == sig);
+  }
+  REQUIRE(fsm.addTransition(hub, 1 + 999 % 50, 999, "dup") == -1);
+  REQUIRE(fsm.addTransition(hub, 1, 999, "other target") == 1000);
+  REQUIRE(fsm.countTransitions() == 1001);
+  for (int sig=0; sig < 1000; sig++) {
+    REQUIRE(fsm.findTransition(hub, 1 + sig % 50, sig) == sig);
+  }
+  REQUIRE(fsm.findTransition(hub, 2, 0) == -1);
+  REQUIRE(fsm.findTransition(-1, 1, 0) == -1);
+
+  // failure transitions are found through failure_trans.
+  int fail = fsm.addTransition(hub, 5, FAILURE_SIGNAL, "fail");
+  REQUIRE(fsm.findTransition(hub, 5, FAILURE_SIGNAL) == fail);
+  REQUIRE(fsm.addTransition(hub, 5, FAILURE_SIGNAL, "fail") == -1);
+  REQUIRE(fsm.findTransition(hub, 6, FAILURE_SIGNAL) == -1);
+
+  // copies carry the index along.
+  FSM copy = fsm;
+  REQUIRE(copy.findTransition(hub, 1, 0) == 0);
+  REQUIRE(copy.addTransition(hub, 1, 0, "dup") == -1);
+}
+
+TEST_CASE("FSM: sorted transitions", "[handle signal]") {
+  // transitions are kept sorted by signal however they are added, and
+  // lookups find them at any fanout.
+  FSM fsm;
+  int hub = fsm.addState("hub");
+  int other = fsm.addState("other");
+  int fail = fsm.addState("fail");
+  for (int i=0; i < 300; i++) {
+    int sig = (i * 7919) % 300 - 100; // shuffled, some negative
+    if (sig == FAILURE_SIGNAL) {
+      sig = 200;
+    }
+    fsm.addTransition(hub, sig % 2 == 0 ? hub : other, sig, "t");
+  }
+  State* st = fsm.getState(hub);
+  REQUIRE(st->trans.size() == 300);
+  REQUIRE(st->signals.size() == 300);
+  for (size_t i=0; i < st->trans.size(); i++) {
+    REQUIRE(fsm.getTransition(st->trans[i])->signal == st->signals[i]);
+    if (i > 0) {
+      REQUIRE(st->signals[i-1] < st->signals[i]);
+    }
+  }
+  for (int sig=-100; sig <= 200; sig++) {
+    if (sig == FAILURE_SIGNAL) {
+      continue;
+    }
+    fsm.setState(hub);
+    REQUIRE(fsm.handleSignal(sig));
+    REQUIRE(fsm.getCurrentState() == (sig % 2 == 0 ? hub : other));
+  }
+  fsm.setState(hub);
+  REQUIRE_FALSE(fsm.handleSignal(201));
+  REQUIRE_FALSE(fsm.handleSignal(-101));
+  fsm.addTransition(hub, fail, FAILURE_SIGNAL, "fail");
+  REQUIRE(fsm.handleSignal(201));
+  REQUIRE(fsm.getCurrentState() == fail);
+
+  // with several transitions on one signal, the first added wins.
+  int first = fsm.addTransition(other, fail, 5, "first");
+  fsm.addTransition(other, hub, 5, "second");
+  fsm.addTransition(other, other, 4, "before");
+  REQUIRE(fsm.matchTransition(other, 5) == first);
+  REQUIRE(fsm.matchTransition(other, 6) == -1);
+  REQUIRE(fsm.matchTransition(-1, 5) == -1);
+
+  int sorted[] = { 1, 3, 3, 5 };
+  REQUIRE(lowerBound(sorted, 4, 0) == 0);
+  REQUIRE(lowerBound(sorted, 4, 3) == 1);
+  REQUIRE(lowerBound(sorted, 4, 4) == 3);
+  REQUIRE(lowerBound(sorted, 4, 6) == 4);
+  REQUIRE(lowerBound(sorted, 0, 6) == 0);
+}
+
+TEST_CASE("FSM: minimize", "[minimize]") {
+  // brain bag's accepting leaves all behave alike, as do the two
+  // N states that can only be followed by S.
+  FSM brain_bag = fsm_brain_bag();
+  vector<int> mapping;
+  FSM min = brain_bag.minimize(&mapping);
+  REQUIRE(mapping.size() == 12);
+  REQUIRE(min.countStates() == 10);
+  REQUIRE(mapping[0] == 0);
+  REQUIRE(min.getDefaultState() == 0);
+  REQUIRE(mapping[7] == mapping[9]);  // G and S
+  REQUIRE(mapping[6] == mapping[11]); // N and N
+  REQUIRE(mapping[6] != mapping[7]);
+  recognize(min, "MONKEY", false, true);
+  recognize(min, "BIN", true, false);
+  recognize(min, "BINS", true, false);
+  recognize(min, "BA", false, false);
+  recognize(min, "BAA", false, true);
+  recognize(min, "BRAIN", true, false);
+  recognize(min, "BRAINS", true, false);
+  recognize(min, "BUS", false, true);
+  same_behavior(brain_bag, min, 128, 1);
+
+  // minimizing twice changes nothing, and minimal machines stay put.
+  REQUIRE(min.minimize(NULL).countStates() == min.countStates());
+  FSM simple = fsm_simple();
+  REQUIRE(simple.minimize(NULL).countStates() == 2);
+
+  // unreachable states are dropped; states that stay put on a signal
+  // only merge with states that also stay put.
+  FSM fsm;
+  int a = fsm.addState("a");
+  int b = fsm.addState("b", true);
+  int c = fsm.addState("c", true);
+  int lost = fsm.addState("lost");
+  fsm.addTransition(a, b, 1, "1");
+  fsm.addTransition(a, c, 2, "2");
+  fsm.addTransition(b, b, 3, "3");
+  fsm.addTransition(lost, a, 1, "1");
+  min = fsm.minimize(&mapping);
+  REQUIRE(min.countStates() == 3);
+  REQUIRE(mapping[lost] == -1);
+  REQUIRE(mapping[b] != mapping[c]);
+  same_behavior(fsm, min, 5, 2);
+  fsm.addTransition(c, c, 3, "3");
+  min = fsm.minimize(&mapping);
+  REQUIRE(min.countStates() == 2);
+  REQUIRE(mapping[b] == mapping[c]);
+  same_behavior(fsm, min, 5, 3);
+
+  // random machines behave the same after minimizing.
+  for (unsigned seed=1; seed <= 20; seed++) {
+    FSM r = fsm_random(40, 4, 2, seed);
+    FSM rmin = r.minimize(NULL);
+    REQUIRE(rmin.countStates() <= r.countStates());
+    same_behavior(r, rmin, 6, seed);
+    REQUIRE(rmin.minimize(NULL).countStates() == rmin.countStates());
+  }
+
+  FSM empty;
+  REQUIRE(empty.minimize(&mapping).countStates() == 0);
+  REQUIRE(mapping.empty());
+}
+
+TEST_CASE("FSM: nondeterministic machines", "[nfa]") {
+  // accepts strings over {a, b} whose second to last symbol is 'a'.
+  // State 0 guesses where that 'a' is.
+  FSM nfa;
+  int s0 = nfa.addState("start");
+  int s1 = nfa.addState("saw a");
+  int s2 = nfa.addState("one more", true);
+  int dead = nfa.addState("dead");
+  nfa.addTransition(s0, s0, (int) 'a', "a");
+  nfa.addTransition(s0, s1, (int) 'a', "a guess");
+  nfa.addTransition(s0, s0, (int) 'b', "b");
+  nfa.addTransition(s1, s2, (int) 'a', "a");
+  nfa.addTransition(s1, s2, (int) 'b', "b");
+  nfa.addTransition(s2, dead, FAILURE_SIGNAL, "too late");
+  REQUIRE_FALSE(nfa.isDeterministic());
+  REQUIRE(fsm_brain_bag().isDeterministic());
+
+  StateSet set;
+  StateSet next;
+  nfa.startSet(set);
+  REQUIRE(set.members() == vector<int>(1, s0));
+  REQUIRE(nfa.stepSet(set, (int) 'a', next));
+  REQUIRE(next.count() == 2);
+  REQUIRE(next.contains(s0));
+  REQUIRE(next.contains(s1));
+  REQUIRE_FALSE(nfa.isAcceptSet(next));
+  set = next;
+  REQUIRE(nfa.stepSet(set, (int) 'b', next));
+  REQUIRE(nfa.isAcceptSet(next));
+  set = next;
+  REQUIRE(nfa.stepSet(set, (int) 'b', next));
+  REQUIRE_FALSE(nfa.isAcceptSet(next));
+  REQUIRE(next.contains(dead));
+
+  // the determinized machine agrees with the set simulation.
+  vector<vector<int> > subsets;
+  FSM dfa = nfa.determinize(&subsets);
+  REQUIRE(dfa.isDeterministic());
+  REQUIRE(subsets.size() == (size_t) dfa.countStates());
+  REQUIRE(subsets[0] == vector<int>(1, s0));
+  const char* inputs[] = { "", "a", "ab", "ba", "bab", "abb", "aaaa", "abba", "x", "ax" };
+  for (size_t i=0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    string input = inputs[i];
+    nfa.startSet(set);
+    dfa.setState(dfa.getDefaultState());
+    for (size_t j=0; j < input.size(); j++) {
+      REQUIRE(nfa.stepSet(set, (int) input[j], next) == dfa.handleSignal((int) input[j]));
+      set = next;
+      REQUIRE(set.members() == subsets[dfa.getCurrentState()]);
+    }
+    size_t n = input.size();
+    bool expect = n >= 2 && input[n-2] == 'a' && input.find('x') == string::npos;
+    REQUIRE(nfa.isAcceptSet(set) == expect);
+    REQUIRE(dfa.isAcceptState() == expect);
+  }
+
+  // on deterministic machines, determinize changes only the labels.
+  FSM brain_bag = fsm_brain_bag();
+  FSM det = brain_bag.determinize(NULL);
+  same_behavior(brain_bag, det, 128, 4);
+
+  // random nondeterministic machines run at DFA speed after
+  // determinizing, minimizing and compiling.
+  for (unsigned seed=1; seed <= 10; seed++) {
+    FSM r = fsm_random(12, 3, 4, seed);
+    FSM d = r.determinize(&subsets).minimize(NULL);
+    CompiledFSM c = d.compile();
+    uint64_t x = seed;
+    for (int run=0; run < 20; run++) {
+      r.startSet(set);
+      int cur = c.getDefaultState();
+      for (int i=0; i < 20; i++) {
+	x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	int sig = (int) ((x >> 33) % 5) - 1;
+	bool went = r.stepSet(set, sig, next);
+	set = next;
+	int to = c.nextState(cur, sig);
+	REQUIRE(went == (to >= 0));
+	cur = to < 0 ? cur : to;
+	REQUIRE(r.isAcceptSet(set) == c.isAcceptState(cur));
+      }
+    }
+  }
+}
+
+TEST_CASE("FSM: regex", "[regex]") {
+  // every pattern has to agree with std::regex_search on every input.
+  const char* patterns[] = {
+    "MOONMAN", "B(RAIN|AG|INS?)", "^BR", "AIN$", "^BAG$", "a*", "a+b",
+    "ab?c", "(ab|cd)*e", "[a-c]x", "[^a-c]x", "\\d+-\\d+", "\\w\\s\\W",
+    "x.y", "a\\.b", "(a|)b", "\\x41", "[\\d_]+z", "", "^$", "^",
+    "[-a]", "(a|b)*abb", "^a|b", "a|b$", "^ab|cd$", "(^a|x)b", "a(b$|c)",
+    "a^b", "a$b", "(^|x)a", "a($|b)", "\\{a\\}", "\\^\\$",
+  };
+  const char* inputs[] = {
+    "", "MOONMAN", "xMOONMANx", "BRAIN", "BAG", "BAGS", "BINS", "XBAG",
+    "aaa", "b", "aab", "ac", "abc", "abbc", "ababcde", "e", "bx", "dx",
+    "12-345", "a-b", "a b", "a\tb!", "xzy", "x\ny", "]", "a.b", "axb",
+    "A", "1_2z", "z", "-", "babb", "ababbx", "xb", "xab", "abx", "xcd",
+    "cdx", "ab", "xac", "xabx", "{a}", "^$", "a^b",
+  };
+  for (size_t i=0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+    Regex re;
+    REQUIRE(re.compile(patterns[i]));
+    REQUIRE(re.getError() == "");
+    std::regex expected(patterns[i]);
+    for (size_t j=0; j < sizeof(inputs) / sizeof(inputs[0]); j++) {
+      INFO("pattern " << patterns[i] << ", input " << inputs[j]);
+      REQUIRE(re.search(inputs[j]) == regex_search(inputs[j], expected));
+    }
+  }
+
+  // the machine is a plain minimized FSM.
+  Regex moonman;
+  REQUIRE(moonman.compile("^MOONMAN$"));
+  FSM& fsm = moonman.getFSM();
+  REQUIRE(fsm.countStates() == 9); // 8 positions plus a dead state
+  REQUIRE(fsm.handleSignals("MOONMAN"));
+  REQUIRE(moonman.getMachine().countStates() == fsm.countStates());
+
+  // bytes above 127, including 0xff, which reads as FAILURE_SIGNAL.
+  Regex high;
+  REQUIRE(high.compile("a[\\x80-\\xff]b"));
+  REQUIRE(high.search("xa\xff" "b"));
+  REQUIRE(high.search("a\x80" "b"));
+  REQUIRE_FALSE(high.search("a\x7f" "b"));
+  REQUIRE(high.compile("a.b"));
+  REQUIRE(high.search("a\xff" "b"));
+  REQUIRE(high.compile("a[^\\xff]b"));
+  REQUIRE_FALSE(high.search("a\xff" "b"));
+  REQUIRE(high.search("a\xfe" "b"));
+
+  // malformed patterns fail and match nothing.
+  const char* bad[] = { "(ab", "ab)", "*a", "a[bc", "a\\", "[z-a]", "\\xg1",
+			"\\bfoo", "a\\1", "a{2}", "{", "a}", "[\\q]" };
+  for (size_t i=0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    Regex re;
+    INFO("pattern " << bad[i]);
+    REQUIRE_FALSE(re.compile(bad[i]));
+    REQUIRE(re.getError() != "");
+    REQUIRE_FALSE(re.search(""));
+  }
+}
+
+TEST_CASE("FSM: aho-corasick keywords", "[keywords]") {
+  AhoCorasick ac;
+  const char* words[] = { "he", "she", "his", "hers" };
+  for (int i=0; i < 4; i++) {
+    REQUIRE(ac.addKeyword(words[i]) == i);
+  }
+  REQUIRE(ac.addKeyword("she") == 1);
+  REQUIRE(ac.addKeyword("") == -1);
+  REQUIRE(ac.countKeywords() == 4);
+  REQUIRE(ac.getKeyword(3) == "hers");
+  REQUIRE(ac.getKeyword(4) == "");
+  FSM& fsm = ac.build();
+  REQUIRE(fsm.countStates() == 10); // the trie's nodes
+  REQUIRE(fsm.isDeterministic());
+
+  // "she" also ends "he", and mismatches fall back to the longest
+  // suffix instead of dying: "shis" still finds "his".
+  vector<KeywordMatch> found;
+  ac.scan("ushershis", found);
+  REQUIRE(found.size() == 4);
+  REQUIRE(found[0].end == 4);
+  REQUIRE(found[0].keyword == 1);
+  REQUIRE(found[1].end == 4);
+  REQUIRE(found[1].keyword == 0);
+  REQUIRE(found[2].end == 6);
+  REQUIRE(found[2].keyword == 3);
+  REQUIRE(found[3].end == 9);
+  REQUIRE(found[3].keyword == 2);
+
+  // the FSM itself accepts exactly where some keyword ends.
+  fsm.setState(fsm.getDefaultState());
+  REQUIRE(fsm.handleSignals("xxshe"));
+  REQUIRE(fsm.getState(fsm.getCurrentState())->label == "she");
+  fsm.handleSignals("Q");
+  REQUIRE(fsm.getCurrentState() == fsm.getDefaultState());
+
+  // compare against a naive search on random text, with keywords that
+  // overlap heavily and one that uses byte 0xff.
+  AhoCorasick many;
+  vector<string> keys;
+  uint64_t x = 99;
+  for (int i=0; i < 60; i++) {
+    string key;
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    int len = 1 + (int) ((x >> 40) % 5);
+    for (int j=0; j < len; j++) {
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      key += (char) ('a' + (x >> 50) % 3);
+    }
+    keys.push_back(key);
+  }
+  keys.push_back("b\xff" "c");
+  for (size_t i=0; i < keys.size(); i++) {
+    many.addKeyword(keys[i]);
+  }
+  many.build();
+  string text;
+  for (int i=0; i < 2000; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    text += (x >> 60) == 0 ? '\xff' : (char) ('a' + (x >> 50) % 4);
+  }
+  found.clear();
+  many.scan(text, found);
+  size_t expected = 0;
+  for (int k=0; k < many.countKeywords(); k++) {
+    string key = many.getKeyword(k);
+    for (size_t pos=text.find(key); pos != string::npos; pos=text.find(key, pos + 1)) {
+      expected++;
+      bool seen = false;
+      for (size_t j=0; j < found.size() && !seen; j++) {
+	seen = found[j].keyword == k && found[j].end == pos + key.size();
+      }
+      REQUIRE(seen);
+    }
+  }
+  REQUIRE(found.size() == expected);
+}
+
+TEST_CASE("FSM: sorted dictionary", "[keywords]") {
+  const char* words[] = { "", "BAG", "BIN", "BINS", "BRAIN", "BRAINS",
+			  "TAP", "TAPS", "TOP", "TOPS", "TOPS" };
+  DictionaryBuilder builder;
+  for (size_t i=0; i < sizeof(words) / sizeof(words[0]); i++) {
+    REQUIRE(builder.addWord(words[i]));
+  }
+  REQUIRE(builder.countWords() == 10);
+  REQUIRE_FALSE(builder.addWord("TAPE")); // out of order
+  FSM& fsm = builder.finish();
+  REQUIRE_FALSE(builder.addWord("ZZZ"));
+
+  // every word is accepted, and nothing else is.
+  for (size_t i=0; i < sizeof(words) / sizeof(words[0]); i++) {
+    fsm.setState(fsm.getDefaultState());
+    REQUIRE(fsm.handleSignals(words[i]));
+  }
+  const char* others[] = { "B", "BA", "BAGS", "BRAINSS", "TAPE", "T", "X",
+			   "TOPSTOP", "MONKEY" };
+  for (size_t i=0; i < sizeof(others) / sizeof(others[0]); i++) {
+    fsm.setState(fsm.getDefaultState());
+    REQUIRE_FALSE(fsm.handleSignals(others[i]));
+  }
+
+  // the result is already minimal: TAP/TOP share everything after the
+  // first letter, and BIN/BRAIN/TAP share their optional S.
+  REQUIRE(fsm.minimize(NULL).countStates() == fsm.countStates());
+  REQUIRE(fsm.countStates() == 11);
+
+  // a larger random dictionary, including byte 0xff, agrees with a
+  // set lookup and stays minimal.
+  vector<string> dict;
+  uint64_t x = 7;
+  for (int i=0; i < 500; i++) {
+    string w;
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    int len = (int) ((x >> 40) % 7);
+    for (int j=0; j < len; j++) {
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      w += (x >> 61) == 0 ? '\xff' : (char) ('a' + (x >> 50) % 4);
+    }
+    dict.push_back(w);
+  }
+  sort(dict.begin(), dict.end());
+  DictionaryBuilder big;
+  for (size_t i=0; i < dict.size(); i++) {
+    REQUIRE(big.addWord(dict[i]));
+  }
+  FSM& bigfsm = big.finish();
+  REQUIRE(bigfsm.minimize(NULL).countStates() == bigfsm.countStates());
+  CompiledFSM c = bigfsm.compile();
+  for (int i=0; i < 3000; i++) {
+    string w;
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    int len = (int) ((x >> 40) % 8);
+    for (int j=0; j < len; j++) {
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      w += (x >> 61) == 0 ? '\xff' : (char) ('a' + (x >> 50) % 5);
+    }
+    bool expect = binary_search(dict.begin(), dict.end(), w);
+    REQUIRE(c.isAcceptState(c.run(c.getDefaultState(), w)) == expect);
+  }
+}
+
+TEST_CASE("FSM: transducer outputs", "[transduce]") {
+  // a hand-built transducer: "ab" -> 7, "ac" -> 3.
+  FSM fsm;
+  fsm.addState("start");
+  fsm.addState("a");
+  fsm.addState("end", true);
+  REQUIRE(fsm.addTransition(0, 1, 'a', "a", 3) >= 0);
+  REQUIRE(fsm.addTransition(1, 2, 'b', "b", 4) >= 0);
+  REQUIRE(fsm.addTransition(1, 2, 'c', "c") >= 0);
+  REQUIRE(fsm.getTransition(2)->output == 0);
+  fsm.getState(2)->final_output = 100;
+  uint64_t value = 0;
+  REQUIRE(fsm.transduce("ab", &value));
+  REQUIRE(value == 107);
+  REQUIRE(fsm.transduce("ac", &value));
+  REQUIRE(value == 103);
+  REQUIRE_FALSE(fsm.transduce("a", &value));
+  REQUIRE(fsm.getCurrentState() == 0);
+
+  // a built map agrees with unordered_map, including for missing keys,
+  // in both the FSM and its packed form.
+  const char* words[] = { "apple", "applesauce", "apply", "banana", "band",
+			  "bandana", "can", "cannot", "canon" };
+  uint64_t values[] = { 5, 2, 9, 40, 40, 1, 0, 17, 3 };
+  unordered_map<string, uint64_t> expect;
+  DictionaryBuilder builder;
+  for (size_t i=0; i < sizeof(words) / sizeof(words[0]); i++) {
+    REQUIRE(builder.addWord(words[i], values[i]));
+    expect[words[i]] = values[i];
+  }
+  REQUIRE(builder.addWord("canon", 3));
+  REQUIRE_FALSE(builder.addWord("canon", 4));
+  FSM& map = builder.finish();
+  PackedFSM packed = map.pack();
+  const char* others[] = { "", "a", "app", "bandan", "cannot!", "zzz" };
+  for (size_t i=0; i < sizeof(words) / sizeof(words[0]); i++) {
+    value = 12345;
+    REQUIRE(map.transduce(words[i], &value));
+    REQUIRE(value == values[i]);
+    value = 12345;
+    REQUIRE(packed.transduce(words[i], &value));
+    REQUIRE(value == values[i]);
+  }
+  for (size_t i=0; i < sizeof(others) / sizeof(others[0]); i++) {
+    REQUIRE_FALSE(map.transduce(others[i], &value));
+    REQUIRE_FALSE(packed.transduce(others[i], &value));
+  }
+
+  // a larger random map, with shared suffixes and values that repeat,
+  // including keys with byte 0xff.
+  vector<pair<string, uint64_t> > entries;
+  uint64_t x = 99;
+  for (int i=0; i < 2000; i++) {
+    string w;
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    int len = 1 + (int) ((x >> 40) % 8);
+    for (int j=0; j < len; j++) {
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      w += (x >> 60) == 0 ? '\xff' : (char) ('a' + (x >> 50) % 6);
+    }
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    entries.push_back(make_pair(w, (x >> 33) % 50));
+  }
+  sort(entries.begin(), entries.end());
+  DictionaryBuilder big;
+  unordered_map<string, uint64_t> truth;
+  for (size_t i=0; i < entries.size(); i++) {
+    if (truth.count(entries[i].first) == 0) {
+      REQUIRE(big.addWord(entries[i].first, entries[i].second));
+      truth[entries[i].first] = entries[i].second;
+    }
+  }
+  FSM& bigmap = big.finish();
+  PackedFSM bigpacked = bigmap.pack();
+  for (unordered_map<string, uint64_t>::iterator it=truth.begin(); it != truth.end(); ++it) {
+    REQUIRE(bigmap.transduce(it->first, &value));
+    REQUIRE(value == it->second);
+    REQUIRE(bigpacked.transduce(it->first, &value));
+    REQUIRE(value == it->second);
+  }
+  for (int i=0; i < 2000; i++) {
+    string w;
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    int len = (int) ((x >> 40) % 9);
+    for (int j=0; j < len; j++) {
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      w += (char) ('a' + (x >> 50) % 7);
+    }
+    bool found = bigmap.transduce(w, &value);
+    REQUIRE(found == (truth.count(w) > 0));
+    if (found) {
+      REQUIRE(value == truth[w]);
+    }
+  }
+}
+
+TEST_CASE("FSM: mapped images", "[image]") {
+  // signals past 255 exercise the sparse table.
+  FSM fsm = fsm_random(200, 300, 4, 11);
+  fsm.addTransition(3, 7, 100000, "far");
+  fsm.addTransition(3, 8, -50, "negative");
+  CompiledFSM c = fsm.compile();
+  string image = MappedFSM::encode(fsm, true);
+
+  // load needs aligned memory, which a string doesn't promise.
+  vector<uint64_t> buf((image.size() + 7) / 8);
+  memcpy(buf.data(), image.data(), image.size());
+  MappedFSM m;
+  REQUIRE(m.load(buf.data(), image.size(), true));
+  REQUIRE(m.getError() == "");
+  REQUIRE(m.countStates() == c.countStates());
+  REQUIRE(m.countClasses() == c.countClasses());
+  REQUIRE(m.getDefaultState() == c.getDefaultState());
+  REQUIRE(m.hasLabels());
+  REQUIRE(m.getLabel(5) == "r5");
+  REQUIRE(m.getLabel(200) == "");
+  for (int s=0; s < c.countStates(); s++) {
+    REQUIRE(m.isAcceptState(s) == c.isAcceptState(s));
+    for (int sig=-1; sig <= 300; sig++) {
+      REQUIRE(m.nextState(s, sig) == c.nextState(s, sig));
+    }
+    REQUIRE(m.nextState(s, 100000) == c.nextState(s, 100000));
+    REQUIRE(m.nextState(s, -50) == c.nextState(s, -50));
+  }
+  string text;
+  for (int i=0; i < 5000; i++) {
+    text += (char) (i * 7919 % 256);
+  }
+  REQUIRE(m.run(m.getDefaultState(), text) == c.run(c.getDefaultState(), text));
+  Cursor cur(m);
+  REQUIRE(cur.handleSignals(m, text) == c.isAcceptState(c.run(c.getDefaultState(), text)));
+
+  // damaged images are refused.
+  vector<uint64_t> bad = buf;
+  ((char*) bad.data())[image.size() - 9] ^= 1;
+  REQUIRE_FALSE(m.load(bad.data(), image.size(), true));
+  REQUIRE(m.getError() == "image checksum mismatch");
+  REQUIRE(m.countStates() == 0);
+  REQUIRE(m.load(bad.data(), image.size(), false)); // unverified
+  REQUIRE_FALSE(m.load(buf.data(), image.size() - 8, true));
+  bad = buf;
+  ((ImageHeader*) bad.data())->version = FSM_IMAGE_VERSION + 1;
+  REQUIRE_FALSE(m.load(bad.data(), image.size(), true));
+  bad = buf;
+  ((ImageHeader*) bad.data())->next_state = image.size();
+  REQUIRE_FALSE(m.load(bad.data(), image.size(), false));
+  REQUIRE_FALSE(m.load((char*) buf.data() + 1, image.size() - 1, true));
+
+  // verify also range-checks every index the run path follows.
+  const ImageHeader* h = (const ImageHeader*) buf.data();
+  uint64_t corrupt[] = {
+    h->byte_class + 4 * 'a', h->char_class + 4 * 200, h->sparse_classes,
+    h->next_state + 4 * 17, h->label_offsets + 8 * 5,
+  };
+  for (size_t i=0; i < sizeof(corrupt) / sizeof(corrupt[0]); i++) {
+    bad = buf;
+    int32_t* value = (int32_t*) ((char*) bad.data() + corrupt[i]);
+    *value = i == 4 ? 1000000 : c.countStates() + c.countClasses();
+    INFO("corruption " << i);
+    REQUIRE_FALSE(m.load(bad.data(), image.size(), true));
+    REQUIRE(m.getError() == "image contents are corrupt");
+  }
+
+  // round trip through a file, without labels.
+  FSM brain = fsm_brain_bag();
+  const char* path = "fsm_test_image.tmp";
+  REQUIRE(MappedFSM::save(brain, path, false));
+  MappedFSM f;
+  REQUIRE(f.open(path, true));
+  remove(path); // the mapping stays valid
+  REQUIRE_FALSE(f.hasLabels());
+  REQUIRE(f.getLabel(0) == "");
+  CompiledFSM bc = brain.compile();
+  const char* words[] = { "BRAIN", "BRAINS", "BAG", "BAGS", "BOGUS", "" };
+  for (size_t i=0; i < sizeof(words) / sizeof(words[0]); i++) {
+    REQUIRE(f.run(f.getDefaultState(), words[i]) == bc.run(bc.getDefaultState(), words[i]));
+  }
+  REQUIRE_FALSE(f.open("no/such/file", true));
+  REQUIRE(f.countStates() == 0);
+
+  // an empty FSM still makes a valid image.
+  FSM empty;
+  image = MappedFSM::encode(empty, true);
+  buf.assign((image.size() + 7) / 8, 0);
+  memcpy(buf.data(), image.data(), image.size());
+  REQUIRE(m.load(buf.data(), image.size(), true));
+  REQUIRE(m.countStates() == 0);
+  REQUIRE(m.getDefaultState() == -1);
+}
+
+TEST_CASE("FSM: text format", "[text]") {
+  FSM fsm = fsm_random(300, 40, 3, 5);
+  fsm.getState(4)->label = "back\\slash\nnew line\r ";
+  fsm.getState(7)->label = "";
+  fsm.getState(9)->final_output = 18446744073709551615ULL;
+  fsm.addTransition(1, 2, 1000000, "big signal", 42);
+  fsm.addTransition(1, 2, -7, "", 0);
+  string text;
+  writeText(fsm, text);
+  REQUIRE(text.substr(0, 6) == "fsm 1 ");
+
+  FSM back;
+  string error;
+  REQUIRE(parseText(text, back, &error));
+  REQUIRE(back.countStates() == fsm.countStates());
+  REQUIRE(back.countTransitions() == fsm.countTransitions());
+  REQUIRE(back.getState(4)->label == fsm.getState(4)->label);
+  REQUIRE(back.getState(9)->final_output == 18446744073709551615ULL);
+  for (int t=0; t < fsm.countTransitions(); t++) {
+    REQUIRE(back.getTransition(t)->label == fsm.getTransition(t)->label);
+    REQUIRE(back.getTransition(t)->signal == fsm.getTransition(t)->signal);
+    REQUIRE(back.getTransition(t)->next_state == fsm.getTransition(t)->next_state);
+    REQUIRE(back.getTransition(t)->output == fsm.getTransition(t)->output);
+  }
+  string again;
+  writeText(back, again);
+  REQUIRE(again == text);
+  same_behavior(fsm, back, 40, 3);
+
+  // files, and CRLF line ends and comments.
+  const char* path = "fsm_test_text.tmp";
+  FSM brain = fsm_brain_bag();
+  REQUIRE(saveText(brain, path));
+  FSM loaded;
+  REQUIRE(loadText(path, loaded, &error));
+  remove(path);
+  same_behavior(brain, loaded, 128, 1);
+  REQUIRE(parseText("# two states\r\nfsm 1 2 1\r\ns 0 0 a\r\n\ns 1 0 b\r\nt 0 1 5 0 go\r\n",
+		    loaded, &error));
+  REQUIRE(loaded.countStates() == 2);
+  REQUIRE(loaded.getState(1)->label == "b");
+  REQUIRE(loaded.handleSignal(5));
+  REQUIRE(loaded.isAcceptState());
+  REQUIRE_FALSE(loadText("no/such/file", loaded, &error));
+
+  // bad input is reported with its line, and leaves the FSM alone.
+  const char* bad[] = {
+    "",
+    "s 0 0 a\n",
+    "fsm 2 0 0\n",
+    "fsm 1 1 0\ns 2 0 a\n",
+    "fsm 1 1 0\ns 0 x a\n",
+    "fsm 1 1 1\ns 0 0 a\nt 0 1 5 0 x\n",
+    "fsm 1 1 2\ns 0 0 a\nt 0 0 5 0 x\nt 0 0 5 0 y\n",
+    "fsm 1 2 0\ns 0 0 a\n",
+    "fsm 1 1 0\ns 0 0 a\\q\n",
+    "fsm 1 1 0\nq\n",
+    "fsm 1 2000000000 2000000000\ns 0 0 a\n", // counts don't size memory
+  };
+  for (size_t i=0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    error = "";
+    REQUIRE_FALSE(parseText(bad[i], loaded, &error));
+    REQUIRE(error.substr(0, 5) == "line ");
+    REQUIRE(loaded.countStates() == 2);
+  }
+  REQUIRE_FALSE(parseText("fsm 1 1 0\ns 1 0 a\nt 0 0 5 0 x\n", loaded, NULL));
+}
+
+// static_simple is fsm_simple, built at compile time.
+constexpr StaticFSM<2, 4> static_simple() {
+  StaticFSM<2, 4> fsm;
+  int even = fsm.addState("Even", true);
+  int odd = fsm.addState("Odd");
+  fsm.addTransition(even, even, 1, "1");
+  fsm.addTransition(even, odd, 0, "0");
+  fsm.addTransition(odd, odd, 1, "1");
+  fsm.addTransition(odd, even, 0, "0");
+  return fsm;
+}
+
+// static_word accepts exactly "GET" and "GETS", and rejects for good
+// once the input leaves them.
+constexpr StaticFSM<6, 12> static_word() {
+  StaticFSM<6, 12> fsm;
+  fsm.addState("start");
+  fsm.addState("G");
+  fsm.addState("GE");
+  fsm.addState("GET", true);
+  fsm.addState("GETS", true);
+  int bogus = fsm.addState("Bogus State");
+  const char* word = "GETS";
+  for (int i=0; i < 4; i++) {
+    fsm.addTransition(i, i + 1, word[i], "next");
+  }
+  for (int i=0; i < 5; i++) {
+    fsm.addTransition(i, bogus, FAILURE_SIGNAL, "fail");
+  }
+  return fsm;
+}
+
+static constexpr StaticFSM<2, 4> even_zeros = static_simple();
+static constexpr StaticFSM<6, 12> get_word = static_word();
+
+static_assert(even_zeros.countStates() == 2, "two states");
+static_assert(even_zeros.countTransitions() == 4, "four transitions");
+static_assert(even_zeros.getLabel(1) == "Odd", "labels are kept");
+static_assert(even_zeros.nextState(0, 0) == 1, "0 flips parity");
+static_assert(even_zeros.nextState(0, 7) == -1, "no transition");
+static_assert(even_zeros.isAcceptState(even_zeros.run(0, string_view("\0\1\0", 3))),
+	      "two zeros are even");
+static_assert(!even_zeros.isAcceptState(even_zeros.run(0, string_view("\1\0", 2))),
+	      "one zero is odd");
+static_assert(get_word.accepts("GET") && get_word.accepts("GETS"), "words");
+static_assert(!get_word.accepts("GE") && !get_word.accepts("GETSS") &&
+	      !get_word.accepts("XGET") && !get_word.accepts(""), "non-words");
+
+TEST_CASE("FSM: compile-time machines", "[static]") {
+  // the constexpr rules match FSM's.
+  StaticFSM<3, 4> small;
+  REQUIRE(small.addTransition(0, 0, 1, "x") == -1); // no states yet
+  REQUIRE(small.getDefaultState() == -1);
+  REQUIRE(small.addState("a") == 0);
+  REQUIRE(small.addState("b", true) == 1);
+  REQUIRE(small.addTransition(0, 1, 5, "x") == 0);
+  REQUIRE(small.addTransition(0, 1, 5, "dup") == -1);
+  REQUIRE(small.addTransition(0, 0, 5, "later") == 1);
+  REQUIRE(small.addTransition(0, 2, 5, "missing") == -1);
+  REQUIRE(small.addTransition(1, 0, FAILURE_SIGNAL, "f") == 2);
+  REQUIRE(small.addTransition(1, 0, FAILURE_SIGNAL, "f") == -1);
+  REQUIRE(small.addTransition(1, 1, 9, "last") == 3);
+  REQUIRE(small.addTransition(1, 0, 8, "full") == -1);
+  REQUIRE(small.addState("c") == 2);
+  REQUIRE(small.addState("d") == -1);
+  REQUIRE(small.nextState(0, 5) == 1); // first added wins
+  REQUIRE(small.nextState(1, 42) == 0); // failure
+
+  // they behave like the FSMs they convert to, alone or in a Cursor.
+  FSM simple = even_zeros.toFSM();
+  FSM expect = fsm_simple();
+  same_behavior(simple, expect, 3, 8);
+  FSM word = get_word.toFSM();
+  FSM small_fsm = small.toFSM();
+  const char* inputs[] = { "GET", "GETS", "GE", "GETT", "" };
+  for (size_t i=0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    word.setState(0);
+    Cursor c(get_word);
+    REQUIRE(c.handleSignals(get_word, inputs[i]) == word.handleSignals(inputs[i]));
+    REQUIRE(c.state == word.getCurrentState());
+  }
+  for (int s=0; s < 3; s++) {
+    for (int sig=-1; sig < 12; sig++) {
+      small_fsm.setState(s);
+      int next = small_fsm.handleSignal(sig) ? small_fsm.getCurrentState() : -1;
+      REQUIRE(small.nextState(s, sig) == next);
+    }
+  }
+}
+
+TEST_CASE("FSM: generated recognizers", "[codegen]") {
+  // compile the generated source into a shared object with the system
+  // compiler, load it, and hold it against handleSignal.
+  FSM machines[] = { fsm_simple(), fsm_brain_bag(), fsm_random(60, 20, 3, 9),
+		     fsm_random(40, 300, 5, 4), FSM() };
+  machines[2].addTransition(0, 1, 100000, "far");
+  machines[2].addTransition(1, 2, -50, "negative");
+  for (size_t m=0; m < sizeof(machines) / sizeof(machines[0]); m++) {
+    FSM& fsm = machines[m];
+    string prefix = "gen" + to_string(m);
+    string src = "fsm_test_gen" + to_string(m) + ".tmp.cpp";
+    string lib = "./fsm_test_gen" + to_string(m) + ".tmp.so";
+    FILE* f = fopen(src.c_str(), "w");
+    REQUIRE(f != NULL);
+    string code = generateCpp(fsm, prefix);
+    fwrite(code.data(), 1, code.size(), f);
+    fclose(f);
+    string cmd = "c++ -O1 -Wall -Werror -shared -fPIC -o " + lib + " " + src;
+    REQUIRE(system(cmd.c_str()) == 0);
+    remove(src.c_str());
+    void* handle = dlopen(lib.c_str(), RTLD_NOW | RTLD_LOCAL);
+    REQUIRE(handle != NULL);
+    remove(lib.c_str());
+
+    typedef int (*StartFn)();
+    typedef int (*NextFn)(int, int);
+    typedef int (*RunFn)(int, const char*, size_t);
+    typedef int (*AcceptsFn)(int);
+    StartFn start = (StartFn) dlsym(handle, (prefix + "_start").c_str());
+    NextFn next = (NextFn) dlsym(handle, (prefix + "_next").c_str());
+    RunFn run = (RunFn) dlsym(handle, (prefix + "_run").c_str());
+    AcceptsFn accepts = (AcceptsFn) dlsym(handle, (prefix + "_accepts").c_str());
+    REQUIRE(start != NULL);
+    REQUIRE(next != NULL);
+    REQUIRE(run != NULL);
+    REQUIRE(accepts != NULL);
+
+    REQUIRE(start() == fsm.getDefaultState());
+    int n = fsm.countStates();
+    for (int s=-1; s <= n; s++) {
+      REQUIRE((accepts(s) == 1) == (s >= 0 && s < n && fsm.getState(s)->accept));
+      int sigs[] = { -1, -50, 0, 1, 48, 65, 100, 127, 200, 255, 299, 100000 };
+      for (size_t i=0; i < sizeof(sigs) / sizeof(sigs[0]); i++) {
+	int expect = -1;
+	if (s >= 0 && s < n) {
+	  fsm.setState(s);
+	  if (fsm.handleSignal(sigs[i])) {
+	    expect = fsm.getCurrentState();
+	  }
+	}
+	REQUIRE(next(s, sigs[i]) == expect);
+      }
+    }
+    uint64_t x = m + 1;
+    for (int i=0; i < 200 && n > 0; i++) {
+      string input;
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      int len = (int) ((x >> 40) % 30);
+      for (int j=0; j < len; j++) {
+	x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	input += (j % 3 == 0) ? (char) (x >> 56) : (char) ('0' + (x >> 50) % 20);
+      }
+      if (m == 1) {
+	input = (i % 2 == 0) ? "BRAINS" : "BAG" + input;
+      }
+      fsm.setState(fsm.getDefaultState());
+      for (size_t j=0; j < input.size(); j++) {
+	fsm.handleSignal((int) input[j]);
+      }
+      int got = run(start(), input.data(), input.size());
+      REQUIRE(got == fsm.getCurrentState());
+      REQUIRE((accepts(got) == 1) == fsm.isAcceptState());
+    }
+    REQUIRE(run(n + 5, "abc", 3) == n + 5);
+    dlclose(handle);
+  }
+}
+
+TEST_CASE("FSM: jit", "[jit]") {
+  // low fanout runs compare chains, high fanout jump tables; bytes
+  // past 0x7f and signals a char can't produce are mixed in.
+  FSM machines[] = { fsm_simple(), fsm_brain_bag(), fsm_random(50, 8, 1, 3),
+		     fsm_random(100, 256, 4, 6), fsm_random(30, 256, 60, 2),
+		     fsm_random(20, 400, 30, 12) };
+  machines[3].addTransition(0, 5, -5, "high byte");
+  machines[4].addTransition(1, 2, -128, "0x80");
+  for (size_t m=0; m < sizeof(machines) / sizeof(machines[0]); m++) {
+    FSM& fsm = machines[m];
+    JitFSM jit;
+    REQUIRE(jit.compile(fsm) == JitFSM::isSupported());
+    REQUIRE(jit.isNative() == JitFSM::isSupported());
+    CompiledFSM c = fsm.compile();
+    REQUIRE(jit.countStates() == c.countStates());
+    REQUIRE(jit.getDefaultState() == c.getDefaultState());
+
+    uint64_t x = m * 31 + 1;
+    for (int i=0; i < 300; i++) {
+      string input;
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      int len = (int) ((x >> 40) % 40);
+      for (int j=0; j < len; j++) {
+	x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	input += (j % 4 == 0) ? (char) (x >> 56) : (char) ((x >> 50) % 12);
+      }
+      if (m == 1) {
+	input = (i % 2 == 0) ? "BRAINS" + input : "BAG";
+      }
+      int start = i % c.countStates();
+      REQUIRE(jit.run(start, input) == c.run(start, input));
+      REQUIRE(jit.isAcceptState(start) == c.isAcceptState(start));
+    }
+    REQUIRE(jit.run(-1, "abc") == -1);
+    REQUIRE(jit.run(c.countStates(), "abc") == c.countStates());
+
+    // Cursors and int signals use the interpreter underneath.
+    fsm.setState(fsm.getDefaultState());
+    Cursor cur(jit);
+    for (int sig=-1; sig < 20; sig++) {
+      REQUIRE(cur.handleSignal(jit, sig) == fsm.handleSignal(sig));
+      REQUIRE(cur.state == fsm.getCurrentState());
+    }
+  }
+
+  JitFSM empty;
+  FSM none;
+  REQUIRE_FALSE(empty.compile(none));
+  REQUIRE(empty.countStates() == 0);
+  REQUIRE(empty.run(0, "abc") == 0);
+}
+
+TEST_CASE("FSM: hit counters", "[counters]") {
+  FSM fsm = fsm_random(30, 10, 2, 21);
+  fsm.addState("dead end"); // no transitions, so every signal misses
+  fsm.addTransition(0, 30, 11, "to dead end");
+  HitCounters hits(fsm.countStates(), fsm.countTransitions());
+  HitShard& shard = hits.local();
+  REQUIRE(&hits.local() == &shard);
+
+  // count by hand alongside.
+  vector<uint64_t> states(fsm.countStates()), trans(fsm.countTransitions());
+  vector<uint64_t> fails(fsm.countStates()), misses(fsm.countStates());
+  vector<int> input;
+  uint64_t x = 5;
+  for (int i=0; i < 5000; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    input.push_back(i % 1000 == 999 ? 11 : (int) ((x >> 40) % 13) - 1);
+  }
+  fsm.freeze(); // counting still sees the transitions
+  fsm.setState(0);
+  for (size_t i=0; i < input.size(); i++) {
+    int s = fsm.getCurrentState();
+    int tr = fsm.matchTransition(s, input[i]);
+    states[s]++;
+    if (tr < 0) {
+      misses[s]++;
+    } else {
+      trans[tr]++;
+      fails[s] += tr == fsm.getState(s)->failure_trans;
+    }
+    bool moved = fsm.handleSignal(input[i], shard);
+    REQUIRE(moved == (tr >= 0));
+  }
+  uint64_t total = 0;
+  for (int s=0; s < fsm.countStates(); s++) {
+    REQUIRE(hits.stateHits(s) == states[s]);
+    REQUIRE(hits.failureHits(s) == fails[s]);
+    REQUIRE(hits.missHits(s) == misses[s]);
+    total += hits.stateHits(s);
+  }
+  REQUIRE(total == input.size());
+  REQUIRE(hits.missHits(30) > 0);
+  for (int t=0; t < fsm.countTransitions(); t++) {
+    REQUIRE(hits.transitionHits(t) == trans[t]);
+  }
+  REQUIRE(hits.stateHits(-1) == 0);
+  REQUIRE(hits.transitionHits(fsm.countTransitions()) == 0);
+
+  // cursors over a shared PackedFSM on several threads count into
+  // their own shards, and the totals merge.
+  hits.reset();
+  REQUIRE(hits.stateHits(0) == 0);
+  PackedFSM packed = fsm.pack();
+  const int num_threads = 4;
+  vector<std::thread> threads;
+  for (int t=0; t < num_threads; t++) {
+    threads.push_back(std::thread([&]() {
+      HitShard& mine = hits.local();
+      Cursor cur(packed);
+      for (size_t i=0; i < input.size(); i++) {
+	cur.handleSignal(packed, input[i], mine);
+      }
+    }));
+  }
+  // totals can be read while the threads count, and never go down.
+  uint64_t seen = 0;
+  bool monotonic = true;
+  for (int i=0; i < 1000; i++) {
+    uint64_t now = hits.stateHits(0);
+    monotonic = monotonic && now >= seen;
+    seen = now;
+  }
+  for (int t=0; t < num_threads; t++) {
+    threads[t].join();
+  }
+  REQUIRE(monotonic);
+  for (int s=0; s < fsm.countStates(); s++) {
+    REQUIRE(hits.stateHits(s) == num_threads * states[s]);
+    REQUIRE(hits.failureHits(s) == num_threads * fails[s]);
+    REQUIRE(hits.missHits(s) == num_threads * misses[s]);
+  }
+  for (int t=0; t < fsm.countTransitions(); t++) {
+    REQUIRE(hits.transitionHits(t) == num_threads * trans[t]);
+  }
+
+  // a new HitCounters never hands out an old one's shard.
+  HitCounters* first = new HitCounters(2, 2);
+  first->local().countState(1);
+  delete first;
+  HitCounters second(2, 2);
+  REQUIRE(second.local().states[1] == 0);
+}
+
+TEST_CASE("FSM: transition traces", "[trace]") {
+  FSM fsm = fsm_brain_bag();
+  TraceRing<TraceRecord> ring(5); // rounds up to 7
+  REQUIRE(ring.capacity() == 7);
+  REQUIRE(sizeof(TraceRecord) == 24);
+  REQUIRE(sizeof(ShortTraceRecord) == 16);
+  string word = "BRAINSXYZ";
+  vector<int> path(1, fsm.getCurrentState());
+  for (size_t i=0; i < word.size(); i++) {
+    fsm.handleSignal((int) word[i], ring);
+    path.push_back(fsm.getCurrentState());
+  }
+  REQUIRE(ring.total() == 9);
+  vector<TraceRecord> recs;
+  ring.snapshot(recs);
+  REQUIRE(recs.size() == 7); // the first two steps were overwritten
+  for (size_t i=0; i < recs.size(); i++) {
+    REQUIRE(recs[i].signal == (int) word[i + 2]);
+    REQUIRE(recs[i].from_state == path[i + 2]);
+    REQUIRE(recs[i].to_state == path[i + 3]);
+    REQUIRE(recs[i].timestamp >= (i > 0 ? recs[i-1].timestamp : 0));
+    if (recs[i].transition >= 0) {
+      REQUIRE(fsm.getTransition(recs[i].transition)->next_state == recs[i].to_state);
+    } else {
+      REQUIRE(recs[i].from_state == recs[i].to_state);
+    }
+  }
+  ostringstream dump;
+  ring.dump(dump);
+  string lines = dump.str();
+  REQUIRE(count(lines.begin(), lines.end(), '\n') == 7);
+  ring.clear();
+  ring.snapshot(recs);
+  REQUIRE(recs.empty());
+
+  // a step with no transition records -1 and stays put.
+  FSM simple = fsm_simple();
+  REQUIRE_FALSE(simple.handleSignal(7, ring));
+  ring.snapshot(recs);
+  REQUIRE(recs.size() == 1);
+  REQUIRE(recs[0].transition == -1);
+  REQUIRE(recs[0].from_state == recs[0].to_state);
+
+  // sampling, short records and cursors.
+  CompiledFSM c = fsm_brain_bag().compile();
+  TraceRing<ShortTraceRecord> sampled(64, 3); // every 4th signal
+  Cursor cur(c);
+  for (int i=0; i < 40; i++) {
+    cur.handleSignal(c, (int) "BAGS"[i % 4], sampled);
+  }
+  REQUIRE(sampled.total() == 10);
+  vector<ShortTraceRecord> short_recs;
+  sampled.snapshot(short_recs);
+  for (size_t i=0; i < short_recs.size(); i++) {
+    REQUIRE(short_recs[i].signal == 'B');
+    REQUIRE(short_recs[i].transition == -1);
+  }
+
+  // a PackedFSM knows its FSM's transition IDs, so cursor traces over
+  // it match the FSM's own.
+  FSM bag = fsm_brain_bag();
+  PackedFSM packed = bag.pack();
+  TraceRing<TraceRecord> fsm_trace(16), packed_trace(16);
+  Cursor packed_cur(packed);
+  for (size_t i=0; i < word.size(); i++) {
+    bag.handleSignal((int) word[i], fsm_trace);
+    packed_cur.handleSignal(packed, (int) word[i], packed_trace);
+  }
+  vector<TraceRecord> fsm_recs, packed_recs;
+  fsm_trace.snapshot(fsm_recs);
+  packed_trace.snapshot(packed_recs);
+  REQUIRE(packed_recs.size() == word.size());
+  bool same_ids = true, any_id = false;
+  for (size_t i=0; i < packed_recs.size(); i++) {
+    same_ids = same_ids && packed_recs[i].transition == fsm_recs[i].transition &&
+      packed_recs[i].to_state == fsm_recs[i].to_state;
+    any_id = any_id || packed_recs[i].transition >= 0;
+  }
+  REQUIRE(same_ids);
+  REQUIRE(any_id);
+
+  // a reader copying while the writer runs never sees a torn chain:
+  // with every signal recorded, each record starts where the one
+  // before it ended.
+  FSM rnd = fsm_random(50, 6, 3, 17);
+  TraceRing<TraceRecord> live(64);
+  std::atomic<bool> done(false);
+  std::thread writer([&]() {
+    uint64_t x = 3;
+    for (int i=0; i < 200000; i++) {
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      rnd.handleSignal((int) ((x >> 40) % 7) - 1, live);
+    }
+    done = true;
+  });
+  bool chained = true;
+  int snapshots = 0;
+  while (!done || snapshots == 0) {
+    live.snapshot(recs);
+    for (size_t i=1; i < recs.size(); i++) {
+      chained = chained && recs[i].from_state == recs[i-1].to_state;
+    }
+    snapshots++;
+  }
+  writer.join();
+  REQUIRE(chained);
+  REQUIRE(live.total() == 200000);
+}
+
+TEST_CASE("FSM: streaming scans", "[scan]") {
+  AhoCorasick ac;
+  ac.addKeyword("he");
+  ac.addKeyword("she");
+  ac.addKeyword("hers");
+  ac.addKeyword("his");
+  ac.build();
+  string text;
+  uint64_t x = 11;
+  for (int i=0; i < 20000; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    text += "hisertab"[(x >> 40) % 8];
+  }
+  vector<KeywordMatch> keyword_matches;
+  ac.scan(text, keyword_matches);
+  vector<uint64_t> expected;
+  for (size_t i=0; i < keyword_matches.size(); i++) {
+    if (expected.empty() || expected.back() != keyword_matches[i].end) {
+      expected.push_back(keyword_matches[i].end);
+    }
+  }
+  REQUIRE(expected.size() > 100);
+
+  Scanner scanner;
+  vector<uint64_t> found;
+  scanner.scan(text, found); // no machine, no matches
+  REQUIRE(found.empty());
+  REQUIRE(scanner.getState() == -1);
+  REQUIRE_FALSE(scanner.load(CompiledFSM()));
+  REQUIRE(scanner.getError() != "");
+  REQUIRE(scanner.load(ac.getMachine()));
+  REQUIRE(scanner.getState() == 0);
+
+  // any split of the input finds the same matches.
+  size_t sizes[] = { 1, 2, 3, 7, 64, 4096, text.size() };
+  for (size_t k=0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+    scanner.reset();
+    found.clear();
+    for (size_t at=0; at < text.size(); at += sizes[k]) {
+      scanner.scan(string_view(text).substr(at, sizes[k]), found);
+    }
+    REQUIRE(found == expected);
+    REQUIRE(scanner.getOffset() == text.size());
+    REQUIRE(scanner.getState() == ac.getMachine().run(0, text));
+  }
+
+  // the callback gets the accept state too.
+  scanner.reset();
+  bool states_match = true;
+  size_t calls = 0;
+  scanner.scan(text, [&](uint64_t end, int state) {
+    vector<int> ids;
+    ac.getMatches(state, ids);
+    states_match = states_match && !ids.empty() &&
+      text.compare(end - ac.getKeyword(ids[0]).size(), ac.getKeyword(ids[0]).size(),
+		   ac.getKeyword(ids[0])) == 0;
+    calls++;
+  });
+  REQUIRE(states_match);
+  REQUIRE(calls == expected.size());
+
+  // files are mapped, and a second file carries on where the first
+  // one stopped.
+  const char* path = "fsm_test_scan.tmp";
+  FILE* f = fopen(path, "wb");
+  REQUIRE(f != NULL);
+  fwrite(text.data(), 1, text.size(), f);
+  fclose(f);
+  scanner.reset();
+  found.clear();
+  REQUIRE(scanner.scanFile(path, found));
+  REQUIRE(found == expected);
+  REQUIRE(scanner.scanFile(path, found));
+  REQUIRE(scanner.getOffset() == 2 * text.size());
+  REQUIRE(found.size() >= 2 * expected.size());
+  REQUIRE(found[expected.size()] > text.size());
+
+  // streams are read in chunks.
+  int fd = open(path, O_RDONLY);
+  REQUIRE(fd >= 0);
+  scanner.reset();
+  found.clear();
+  REQUIRE(scanner.scanStream(fd, [&](uint64_t end, int) {
+    found.push_back(end);
+  }));
+  close(fd);
+  REQUIRE(found == expected);
+  remove(path);
+
+  REQUIRE_FALSE(scanner.scanFile("fsm_test_no_such_file.tmp", found));
+  REQUIRE(scanner.getError().find("can't open") == 0);
+
+  // an empty file scans nothing.
+  f = fopen(path, "wb");
+  fclose(f);
+  scanner.reset();
+  found.clear();
+  REQUIRE(scanner.scanFile(path, found));
+  REQUIRE(found.empty());
+  REQUIRE(scanner.getOffset() == 0);
+  remove(path);
+
+  // keywords that end on adjacent bytes are all reported, including
+  // one that ends right after another copy of itself.
+  AhoCorasick adjacent;
+  adjacent.addKeyword("ab");
+  adjacent.addKeyword("b");
+  adjacent.addKeyword("a");
+  adjacent.build();
+  REQUIRE(scanner.load(adjacent.getMachine()));
+  found.clear();
+  scanner.scan("abb", found);
+  REQUIRE(found == vector<uint64_t>({ 1, 2, 3 }));
+  scanner.reset();
+  found.clear();
+  scanner.scan("xaab", found);
+  REQUIRE(found == vector<uint64_t>({ 2, 3, 4 }));
+
+  // high bytes work, and a machine that stays accepting reports the
+  // offset it entered the accept state at, once, however the input is
+  // split.
+  Regex re;
+  REQUIRE(re.compile("\\xff\\x80"));
+  REQUIRE(scanner.load(re.getMachine()));
+  found.clear();
+  scanner.scan("a\xff\x80" "b\xff\x80", found);
+  REQUIRE(found == vector<uint64_t>(1, 3));
+  REQUIRE(re.compile("ERROR"));
+  REQUIRE(scanner.load(re.getMachine()));
+  string log = "x ERROR a b c\nINFO ok\nok\n";
+  for (size_t split=0; split <= log.size(); split++) {
+    scanner.reset();
+    found.clear();
+    scanner.scan(string_view(log).substr(0, split), found);
+    scanner.scan(string_view(log).substr(split), found);
+    REQUIRE(found == vector<uint64_t>(1, 7));
+  }
+
+  // bytes with no transition stay put, as in FSM::handleSignal, so
+  // they neither enter nor leave an accept state. Leaving and coming
+  // back is reported again, and so is a transition from an accept
+  // state back to itself.
+  FSM toggle = fsm_simple(); // accepts after an even number of 0s
+  REQUIRE(scanner.load(toggle.compile()));
+  found.clear();
+  int signals[] = { 0, 5, 0, 1, 0, 0 };
+  string bytes;
+  for (size_t i=0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+    bytes += (char) signals[i];
+  }
+  scanner.scan(bytes, found);
+  REQUIRE(found == vector<uint64_t>({ 3, 4, 6 }));
+}
+
+// counter_fsm returns a machine whose state counts the bytes it has
+// seen, mod n, accepting at 0. Its states never merge.
+FSM counter_fsm(int n) {
+  FSM fsm;
+  for (int s=0; s < n; s++) {
+    fsm.addState("count", s == 0);
+  }
+  for (int s=0; s < n; s++) {
+    fsm.addTransition(s, (s + 1) % n, FAILURE_SIGNAL, "tick");
+  }
+  return fsm;
+}
+
+TEST_CASE("FSM: parallel scans", "[scan]") {
+  string text;
+  uint64_t x = 5;
+  for (int i=0; i < (1 << 20) + 12345; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    text += "hisertab"[(x >> 40) % 8];
+  }
+  AhoCorasick ac;
+  ac.addKeyword("she");
+  ac.addKeyword("hers");
+  ac.addKeyword("babies");
+  ac.build();
+  Regex re;
+  REQUIRE(re.compile("e[rt]+s$"));
+  vector<FSM> fsms;
+  fsms.push_back(ac.getFSM());
+  fsms.push_back(re.getFSM());
+  Regex sticky; // stays accepting after the first match
+  REQUIRE(sticky.compile("heh"));
+  fsms.push_back(sticky.getFSM());
+  fsms.push_back(counter_fsm(7));    // never merges, but few states
+  fsms.push_back(counter_fsm(64));   // never merges; chunks give up
+  fsms.push_back(counter_fsm(1000)); // guesses wrong
+  fsms.push_back(fsm_random(3000, 128, 3, 23)); // guesses
+  for (size_t m=0; m < fsms.size(); m++) {
+    CompiledFSM machine = fsms[m].compile();
+    Scanner sequential, parallel;
+    REQUIRE(sequential.load(machine));
+    REQUIRE(parallel.load(machine));
+    int thread_counts[] = { 0, 1, 2, 3, 8 };
+    for (size_t k=0; k < sizeof(thread_counts) / sizeof(thread_counts[0]); k++) {
+      // starting part way through a scan, too.
+      vector<uint64_t> expected, found;
+      sequential.reset();
+      parallel.reset();
+      sequential.scan(string_view(text).substr(0, 1000 * k), expected);
+      parallel.scan(string_view(text).substr(0, 1000 * k), found);
+      sequential.scan(text, expected);
+      parallel.scanParallel(text, found, thread_counts[k]);
+      REQUIRE(found == expected);
+      REQUIRE(parallel.getState() == sequential.getState());
+      REQUIRE(parallel.getOffset() == sequential.getOffset());
+    }
+  }
+
+  // keywords that end on adjacent bytes give the same ends as
+  // AhoCorasick::scan, scanned either way.
+  AhoCorasick adjacent;
+  adjacent.addKeyword("ab");
+  adjacent.addKeyword("b");
+  adjacent.build();
+  string ab;
+  for (int i=0; i < (1 << 19); i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    ab += "abc"[(x >> 40) % 3];
+  }
+  vector<KeywordMatch> keyword_matches;
+  adjacent.scan(ab, keyword_matches);
+  vector<uint64_t> ends;
+  for (size_t i=0; i < keyword_matches.size(); i++) {
+    if (ends.empty() || ends.back() != keyword_matches[i].end) {
+      ends.push_back(keyword_matches[i].end);
+    }
+  }
+  Scanner adjacent_scanner;
+  REQUIRE(adjacent_scanner.load(adjacent.getMachine()));
+  vector<uint64_t> adjacent_found;
+  adjacent_scanner.scan(ab, adjacent_found);
+  REQUIRE(adjacent_found == ends);
+  adjacent_scanner.reset();
+  adjacent_found.clear();
+  adjacent_scanner.scanParallel(ab, adjacent_found, 4);
+  REQUIRE(adjacent_found == ends);
+
+  // small inputs are scanned on the calling thread.
+  Scanner scanner;
+  REQUIRE(scanner.load(ac.getMachine()));
+  vector<uint64_t> found;
+  scanner.scanParallel("babies", found, 4);
+  REQUIRE(found == vector<uint64_t>(1, 6));
+}
+
+TEST_CASE("FSM: batch recognition", "[batch]") {
+  DictionaryBuilder builder;
+  builder.addWord("bag");
+  builder.addWord("bags");
+  builder.addWord("brain");
+  builder.addWord("brains");
+  FSM& dict = builder.finish();
+  CompiledFSM compiled = dict.compile();
+  PackedFSM packed = dict.pack();
+
+  // inputs of very different lengths, so some batches are slower.
+  vector<string> storage;
+  uint64_t x = 9;
+  for (int i=0; i < 5000; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    const char* words[] = { "bag", "bags", "brain", "brains", "bra", "", "bagss" };
+    string w = words[(x >> 40) % 7];
+    if ((x >> 20) % 50 == 0) {
+      w = string(10000, 'b');
+    }
+    storage.push_back(w);
+  }
+  vector<string_view> inputs(storage.begin(), storage.end());
+
+  int thread_counts[] = { 1, 3, 0 };
+  size_t counts[] = { 0, 1, 63, 64, 65, 1024, 1025, 5000 };
+  for (size_t t=0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+    BatchRecognizer batch(thread_counts[t]);
+    REQUIRE(batch.countThreads() >= 1);
+    for (size_t c=0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+      size_t n = counts[c];
+      vector<uint64_t> accepted(3, ~(uint64_t) 0), accepted_packed;
+      batch.recognizeAll(compiled, inputs.data(), n, accepted);
+      batch.recognizeAll(packed, inputs.data(), n, accepted_packed);
+      REQUIRE(accepted.size() == (n + 63) / 64);
+      REQUIRE(accepted == accepted_packed);
+      bool same = true;
+      for (size_t i=0; i < n; i++) {
+	bool bit = (accepted[i / 64] >> (i % 64)) & 1;
+	same = same && bit == compiled.isAcceptState(compiled.run(0, inputs[i]));
+      }
+      REQUIRE(same);
+    }
+  }
+
+  BatchRecognizer batch(2);
+  vector<uint64_t> accepted;
+  batch.recognizeAll(compiled, inputs, accepted);
+  REQUIRE(accepted.size() == (inputs.size() + 63) / 64);
+}
+
 FSM fsm_simple() {
   FSM fsm;
   int even = fsm.addState("Even", true);
@@ -321,6 +2018,50 @@ FSM fsm_brain_bag() {
   return fsm;
 }
 
+// fsm_random builds a machine with the given number of states where
+// each state has up to `fanout` transitions on signals in [0,
+// num_signals), about half of the states accept, and about half have
+// a failure transition. The same seed always builds the same machine.
+FSM fsm_random(int num_states, int num_signals, int fanout, unsigned seed) {
+  FSM fsm;
+  uint64_t x = seed * 0x9e3779b97f4a7c15ULL + 1;
+  for (int i=0; i < num_states; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    fsm.addState("r" + to_string(i), (x >> 40) & 1);
+  }
+  for (int i=0; i < num_states; i++) {
+    for (int j=0; j < fanout; j++) {
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      int sig = (int) ((x >> 33) % num_signals);
+      int target = (int) ((x >> 13) % num_states);
+      fsm.addTransition(i, target, sig, "t");
+    }
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    if ((x >> 45) & 1) {
+      fsm.addTransition(i, (int) ((x >> 17) % num_states), FAILURE_SIGNAL, "f");
+    }
+  }
+  return fsm;
+}
+
+// same_behavior feeds both machines the same random signals in
+// [-1, num_signals], starting from their default states, and
+// requires handleSignal and isAcceptState to agree at every step.
+void same_behavior(FSM& a, FSM& b, int num_signals, unsigned seed) {
+  uint64_t x = seed * 0x9e3779b97f4a7c15ULL + 7;
+  for (int run=0; run < 50; run++) {
+    a.setState(a.getDefaultState());
+    b.setState(b.getDefaultState());
+    REQUIRE(a.isAcceptState() == b.isAcceptState());
+    for (int i=0; i < 30; i++) {
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      int sig = (int) ((x >> 33) % (num_signals + 2)) - 1;
+      REQUIRE(a.handleSignal(sig) == b.handleSignal(sig));
+      REQUIRE(a.isAcceptState() == b.isAcceptState());
+    }
+  }
+}
+
 /**
  * In case you are curious: this treats the FSM like a text input
  * recognizer. It resets the FSM to a default state and then processes
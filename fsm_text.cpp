@@ -0,0 +1,312 @@
+//
+// fsm_text.cpp
+//
+
+#include "fsm_text.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+
+using namespace std;
+
+namespace {
+
+// appendNumber appends the decimal form of a number.
+template <class T>
+void appendNumber(string& out, T value) {
+  char buf[24];
+  to_chars_result r = to_chars(buf, buf + sizeof(buf), value);
+  out.append(buf, r.ptr - buf);
+}
+
+// appendLabel appends a label with its line breaks and backslashes
+// escaped.
+void appendLabel(string& out, const string& label) {
+  size_t start = 0;
+  for (size_t i=0; i < label.size(); i++) {
+    char c = label[i];
+    if (c == '\\' || c == '\n' || c == '\r') {
+      out.append(label, start, i - start);
+      out += '\\';
+      out += c == '\n' ? 'n' : c == '\r' ? 'r' : '\\';
+      start = i + 1;
+    }
+  }
+  out.append(label, start, string::npos);
+  out += '\n';
+}
+
+// appendHeader, appendState and appendTransition append one line
+// each.
+void appendHeader(string& out, int num_states, int num_transitions) {
+  out += "fsm ";
+  appendNumber(out, FSM_TEXT_VERSION);
+  out += ' ';
+  appendNumber(out, num_states);
+  out += ' ';
+  appendNumber(out, num_transitions);
+  out += '\n';
+}
+
+void appendState(string& out, State* st) {
+  out += st->accept ? "s 1 " : "s 0 ";
+  appendNumber(out, st->final_output);
+  out += ' ';
+  appendLabel(out, st->label);
+}
+
+void appendTransition(string& out, int from, Transition* tr) {
+  out += "t ";
+  appendNumber(out, from);
+  out += ' ';
+  appendNumber(out, tr->next_state);
+  out += ' ';
+  appendNumber(out, tr->signal);
+  out += ' ';
+  appendNumber(out, tr->output);
+  out += ' ';
+  appendLabel(out, tr->label);
+}
+
+// sourceStates returns the state each transition leaves from, which
+// Transition itself doesn't record, and counts the transitions that
+// still belong to a state. A failure transition that was replaced by
+// a later one belongs to none and gets -1.
+vector<int> sourceStates(FSM& fsm, int* num_kept) {
+  vector<int> from(fsm.countTransitions(), -1);
+  for (int s=0; s < fsm.countStates(); s++) {
+    State* st = fsm.getState(s);
+    for (size_t i=0; i < st->trans.size(); i++) {
+      from[st->trans[i]] = s;
+    }
+    if (st->failure_trans >= 0) {
+      from[st->failure_trans] = s;
+    }
+  }
+  *num_kept = 0;
+  for (size_t t=0; t < from.size(); t++) {
+    *num_kept += from[t] >= 0;
+  }
+  return from;
+}
+
+// LineReader splits a line into space-separated fields without
+// copying it.
+class LineReader {
+public:
+  string_view rest; // the part of the line not read yet
+
+  // number reads the next field as a number and returns false if it
+  // isn't one.
+  template <class T>
+  bool number(T& value) {
+    const char* end = rest.data() + rest.size();
+    from_chars_result r = from_chars(rest.data(), end, value);
+    if (r.ec != errc() || (r.ptr != end && *r.ptr != ' ')) {
+      return false;
+    }
+    rest.remove_prefix(r.ptr - rest.data());
+    if (!rest.empty()) {
+      rest.remove_prefix(1);
+    }
+    return true;
+  }
+
+  // label reads the rest of the line as an escaped label.
+  bool label(string& out) {
+    out.clear();
+    size_t start = 0;
+    for (size_t i=0; i < rest.size(); i++) {
+      if (rest[i] != '\\') {
+	continue;
+      }
+      out.append(rest.data() + start, i - start);
+      if (i + 1 == rest.size()) {
+	return false;
+      }
+      char c = rest[++i];
+      if (c == 'n') {
+	out += '\n';
+      } else if (c == 'r') {
+	out += '\r';
+      } else if (c == '\\') {
+	out += '\\';
+      } else {
+	return false;
+      }
+      start = i + 1;
+    }
+    out.append(rest.data() + start, rest.size() - start);
+    return true;
+  }
+};
+
+} // namespace
+
+void writeText(FSM& fsm, string& out) {
+  int num_kept;
+  vector<int> from = sourceStates(fsm, &num_kept);
+  appendHeader(out, fsm.countStates(), num_kept);
+  for (int s=0; s < fsm.countStates(); s++) {
+    appendState(out, fsm.getState(s));
+  }
+  for (int t=0; t < fsm.countTransitions(); t++) {
+    if (from[t] >= 0) {
+      appendTransition(out, from[t], fsm.getTransition(t));
+    }
+  }
+}
+
+bool saveText(FSM& fsm, const string& path) {
+  FILE* f = fopen(path.c_str(), "wb");
+  if (f == NULL) {
+    return false;
+  }
+  // lines collect in one buffer that goes out whenever it passes a
+  // megabyte, so a huge machine never needs its whole text in memory.
+  const size_t chunk = 1 << 20;
+  string buf;
+  buf.reserve(chunk + 4096);
+  bool ok = true;
+  auto flush = [&]() {
+    ok = ok && fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+    buf.clear();
+  };
+  int num_kept;
+  vector<int> from = sourceStates(fsm, &num_kept);
+  appendHeader(buf, fsm.countStates(), num_kept);
+  for (int s=0; s < fsm.countStates(); s++) {
+    appendState(buf, fsm.getState(s));
+    if (buf.size() >= chunk) {
+      flush();
+    }
+  }
+  for (int t=0; t < fsm.countTransitions(); t++) {
+    if (from[t] < 0) {
+      continue;
+    }
+    appendTransition(buf, from[t], fsm.getTransition(t));
+    if (buf.size() >= chunk) {
+      flush();
+    }
+  }
+  flush();
+  return fclose(f) == 0 && ok;
+}
+
+bool parseText(string_view text, FSM& fsm, string* error) {
+  FSM out;
+  int line_no = 0;
+  int num_states = -1, num_transitions = -1;
+  string label;
+  string problem;
+  while (!text.empty()) {
+    size_t nl = text.find('\n');
+    string_view line = text.substr(0, nl);
+    text.remove_prefix(nl == string_view::npos ? text.size() : nl + 1);
+    line_no++;
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+
+    LineReader r;
+    if (num_states < 0) {
+      int version = -1;
+      r.rest = line.substr(line.size() > 4 ? 4 : line.size());
+      if (line.substr(0, 4) != "fsm " || !r.number(version)) {
+	problem = "missing fsm header";
+      } else if (version != FSM_TEXT_VERSION) {
+	problem = "unsupported version " + to_string(version);
+      } else if (!r.number(num_states) || !r.number(num_transitions) ||
+		 num_states < 0 || num_transitions < 0 || !r.rest.empty()) {
+	problem = "bad fsm header";
+      } else {
+	// the counts can't be trusted to size memory by, but the
+	// lines still to come bound them: a state line is at least
+	// "s 0 0\n" and a transition line "t 0 0 0 0\n".
+	out.reserve((int) min((size_t) num_states, text.size() / 6 + 1),
+		    (int) min((size_t) num_transitions, text.size() / 10 + 1));
+      }
+      if (!problem.empty()) {
+	break;
+      }
+      continue;
+    }
+
+    r.rest = line.substr(line.size() > 2 ? 2 : line.size());
+    if (line.substr(0, 2) == "s ") {
+      int accept;
+      uint64_t final_output;
+      if (!r.number(accept) || (accept != 0 && accept != 1) ||
+	  !r.number(final_output) || !r.label(label)) {
+	problem = "bad state";
+      } else {
+	int id = out.addState(label, accept == 1);
+	out.getState(id)->final_output = final_output;
+      }
+    } else if (line.substr(0, 2) == "t ") {
+      int from, to, signal;
+      uint64_t output;
+      if (!r.number(from) || !r.number(to) || !r.number(signal) ||
+	  !r.number(output) || !r.label(label)) {
+	problem = "bad transition";
+      } else if (out.addTransition(from, to, signal, label, output) < 0) {
+	problem = "transition to a missing state, or a duplicate";
+      }
+    } else {
+      problem = "unknown line";
+    }
+    if (!problem.empty()) {
+      break;
+    }
+  }
+
+  if (problem.empty()) {
+    if (num_states < 0) {
+      problem = "missing fsm header";
+    } else if (out.countStates() != num_states ||
+	       out.countTransitions() != num_transitions) {
+      problem = "expected " + to_string(num_states) + " states and " +
+	to_string(num_transitions) + " transitions";
+    } else {
+      fsm.swap(out);
+      return true;
+    }
+  }
+  if (error != NULL) {
+    *error = "line " + to_string(line_no) + ": " + problem;
+  }
+  return false;
+}
+
+bool loadText(const string& path, FSM& fsm, string* error) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (f == NULL) {
+    if (error != NULL) {
+      *error = "can't open " + path;
+    }
+    return false;
+  }
+  // read the whole file with one call; the parser then works on views
+  // into it.
+  string text;
+  bool ok = fseek(f, 0, SEEK_END) == 0;
+  long size = ok ? ftell(f) : -1;
+  if (size > 0 && fseek(f, 0, SEEK_SET) == 0) {
+    text.resize(size);
+    ok = fread(&text[0], 1, size, f) == (size_t) size;
+  } else {
+    ok = ok && size == 0;
+  }
+  fclose(f);
+  if (!ok) {
+    if (error != NULL) {
+      *error = "can't read " + path;
+    }
+    return false;
+  }
+  return parseText(text, fsm, error);
+}
@@ -0,0 +1,50 @@
+//
+// fsm_text.hpp
+//
+// A line-oriented text format for saving and loading FSMs.
+//
+
+#ifndef __fsm_text_h__
+#define __fsm_text_h__
+
+#include <string>
+#include <string_view>
+#include "fsm.hpp"
+
+using namespace std;
+
+#define FSM_TEXT_VERSION 1
+
+// The text format holds everything needed to rebuild an FSM with the
+// same state and transition IDs:
+//
+//   fsm 1 <num_states> <num_transitions>
+//   s <accept> <final_output> <label>
+//   t <from> <to> <signal> <output> <label>
+//
+// There is one `s` line per state and one `t` line per transition,
+// each in ID order, with state 0 as the default state. Failure
+// transitions are `t` lines with signal -1. A failure transition that
+// a later one replaced is not written, which moves the IDs of the
+// transitions after it down by one. <accept> is 0 or 1, and a
+// label runs to the end of its line with `\`, newline and carriage
+// return written as \\, \n and \r. Empty lines and lines starting
+// with `#` are ignored.
+
+// writeText appends the text form of the FSM to `out`.
+void writeText(FSM& fsm, string& out);
+
+// saveText writes the text form of the FSM to a file a large chunk at
+// a time. It returns false if the file could not be written.
+bool saveText(FSM& fsm, const string& path);
+
+// parseText replaces `fsm` with the machine described by the text. If
+// the text is not valid it returns false, leaves `fsm` unchanged and,
+// if `error` is not NULL, stores a message naming the bad line there.
+bool parseText(string_view text, FSM& fsm, string* error);
+
+// loadText reads a file written by saveText and parses it like
+// parseText.
+bool loadText(const string& path, FSM& fsm, string* error);
+
+#endif
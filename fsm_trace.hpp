@@ -0,0 +1,292 @@
+//
+// fsm_trace.hpp
+//
+// A fixed-size ring buffer that records the transitions a machine
+// takes, for finding out after the fact how it got where it is.
+//
+
+#ifndef __fsm_trace_h__
+#define __fsm_trace_h__
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+#include <vector>
+#include "fsm.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+// traceClock returns the timestamp stored in trace records: the TSC
+// on x86, which is cheap to read and ticks at a fixed rate, and
+// nanoseconds from a steady clock elsewhere.
+inline uint64_t traceClock() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return chrono::duration_cast<chrono::nanoseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// TraceRecord is one traced step, 24 bytes long.
+class TraceRecord {
+public:
+  uint64_t timestamp; // traceClock() when the signal was handled
+  int from_state;     // state before the signal
+  int signal;
+  int transition;     // transition taken, or -1 if there was none or
+		      // the machine doesn't know transition IDs
+  int to_state;       // state after the signal
+
+  TraceRecord() {}
+
+  TraceRecord(uint64_t timestamp, int from_state, int signal,
+	      int transition, int to_state) {
+    this->timestamp = timestamp;
+    this->from_state = from_state;
+    this->signal = signal;
+    this->transition = transition;
+    this->to_state = to_state;
+  }
+
+  // hasTimestamp tells TraceRing whether to read the clock at all.
+  static const bool hasTimestamp = true;
+};
+
+// ShortTraceRecord is a 16 byte traced step without a timestamp, for
+// twice the history in the same memory and no clock reads.
+class ShortTraceRecord {
+public:
+  int from_state;
+  int signal;
+  int transition;
+  int to_state;
+
+  ShortTraceRecord() {}
+
+  ShortTraceRecord(uint64_t, int from_state, int signal,
+		   int transition, int to_state) {
+    this->from_state = from_state;
+    this->signal = signal;
+    this->transition = transition;
+    this->to_state = to_state;
+  }
+
+  static const bool hasTimestamp = false;
+};
+
+// TraceRing keeps the most recent records of the steps taken by an
+// FSM or a Cursor, overwriting the oldest once it is full. Record is
+// TraceRecord or ShortTraceRecord, or any trivially copyable class
+// with the same constructor and hasTimestamp member.
+//
+// A ring has a single writer: one FSM, or the cursors of one thread.
+// Each record is kept as 64-bit atomic words, and writing one is a
+// relaxed store of each word followed by a release store of the write
+// count, with no locks and no atomic read-modify-write; on x86 those
+// are plain stores, so it is cheap enough to leave on. Only every Nth
+// signal is recorded if a sampling interval is set. Other threads may
+// call snapshot at any time. They read the words with relaxed loads
+// and then check the write count again, like a seqlock, to leave out
+// records the writer overwrote while they were being copied.
+template <class Record>
+class TraceRing {
+private:
+  static_assert(std::is_trivially_copyable<Record>::value,
+		"trace records are copied word by word");
+
+  // record_words is the number of words a record takes in the ring.
+  static const size_t record_words = (sizeof(Record) + 7) / 8;
+
+  vector<std::atomic<uint64_t>> words; // the ring, record_words per
+				       // slot. It has a power of two
+				       // slots, one more than the
+				       // capacity, so the slot being
+				       // written is never one a reader
+				       // wants.
+
+  size_t slots; // the number of slots
+
+  size_t mask; // slots - 1
+
+  uint64_t written; // records ever written. Writer only.
+
+  std::atomic<uint64_t> published; // `written`, for readers
+
+  uint64_t sample_mask; // record the signals where seen & mask is 0
+
+  uint64_t seen; // signals offered to sample(). Writer only.
+
+  TraceRing(const TraceRing&);
+  TraceRing& operator=(const TraceRing&);
+
+public:
+
+  // TraceRing constructs an empty ring that keeps the last `capacity`
+  // records and records one signal out of every `sample_every`. The
+  // capacity is rounded up to one less than a power of two, and the
+  // sampling interval up to a power of two.
+  explicit TraceRing(size_t capacity, unsigned sample_every = 1) : published(0) {
+    size_t cap = 2;
+    while (cap < capacity + 1) {
+      cap *= 2;
+    }
+    vector<std::atomic<uint64_t>> ring(cap * record_words);
+    words.swap(ring);
+    slots = cap;
+    mask = cap - 1;
+    uint64_t every = 1;
+    while (every < sample_every) {
+      every *= 2;
+    }
+    sample_mask = every - 1;
+    written = 0;
+    seen = 0;
+  }
+
+  // sample returns true if the next signal should be recorded. The
+  // writer calls it once per signal.
+  bool sample() {
+    return (seen++ & sample_mask) == 0;
+  }
+
+  // record appends a step, overwriting the oldest if the ring is full.
+  void record(int from_state, int signal, int transition, int to_state) {
+    uint64_t ts = Record::hasTimestamp ? traceClock() : 0;
+    Record r(ts, from_state, signal, transition, to_state);
+    uint64_t w[record_words] = {};
+    memcpy(w, &r, sizeof(r));
+    // a reader that sees any of these words must also see the count
+    // published before them, so it knows this slot is being reused.
+    std::atomic_thread_fence(std::memory_order_release);
+    std::atomic<uint64_t>* slot = &words[(written & mask) * record_words];
+    for (size_t i=0; i < record_words; i++) {
+      slot[i].store(w[i], std::memory_order_relaxed);
+    }
+    written++;
+    published.store(written, std::memory_order_release);
+  }
+
+  // capacity returns the number of records the ring keeps.
+  size_t capacity() const {
+    return slots - 1;
+  }
+
+  // total returns the number of records ever written, including the
+  // ones that have since been overwritten.
+  uint64_t total() const {
+    return published.load(std::memory_order_acquire);
+  }
+
+  // snapshot replaces `out` with the records still in the ring,
+  // oldest first.
+  void snapshot(vector<Record>& out) const {
+    out.clear();
+    uint64_t end = published.load(std::memory_order_acquire);
+    uint64_t begin = end > capacity() ? end - capacity() : 0;
+    uint64_t w[record_words];
+    Record r;
+    for (uint64_t i=begin; i < end; i++) {
+      const std::atomic<uint64_t>* slot = &words[(i & mask) * record_words];
+      for (size_t k=0; k < record_words; k++) {
+	w[k] = slot[k].load(std::memory_order_relaxed);
+      }
+      memcpy(&r, w, sizeof(r));
+      out.push_back(r);
+    }
+    // the writer may have lapped us while we copied. Any word we read
+    // from a reused slot comes with a count at least as new as the
+    // one published before it was written, so everything from before
+    // now - capacity may be torn.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t now = published.load(std::memory_order_relaxed);
+    if (now + 1 > slots && now + 1 - slots > begin) {
+      size_t torn = now + 1 - slots - begin;
+      out.erase(out.begin(), out.begin() + (torn < out.size() ? torn : out.size()));
+    }
+  }
+
+  // dump writes the records still in the ring to `out`, oldest first,
+  // one per line.
+  void dump(ostream& out) const {
+    vector<Record> recs;
+    snapshot(recs);
+    for (size_t i=0; i < recs.size(); i++) {
+      const Record& r = recs[i];
+      if (Record::hasTimestamp) {
+	out << traceTimestamp(r) << " ";
+      }
+      out << r.from_state << " --(" << r.signal << ")";
+      if (r.transition >= 0) {
+	out << " #" << r.transition;
+      }
+      out << "--> " << r.to_state << "\n";
+    }
+  }
+
+  // clear forgets every record. Only the writer may call it.
+  void clear() {
+    written = 0;
+    seen = 0;
+    published.store(0, std::memory_order_release);
+  }
+
+private:
+  static uint64_t traceTimestamp(const TraceRecord& r) {
+    return r.timestamp;
+  }
+
+  template <class Other>
+  static uint64_t traceTimestamp(const Other&) {
+    return 0;
+  }
+};
+
+template <class Record>
+bool FSM::handleSignal(int signal, TraceRing<Record>& trace) {
+  if (!trace.sample()) {
+    return handleSignal(signal);
+  }
+  int from = state;
+  int tr = matchTransition(state, signal);
+  bool moved = handleSignal(signal);
+  trace.record(from, signal, moved ? tr : -1, state);
+  return moved;
+}
+
+// traceTransition returns the FSM transition ID the machine would
+// take from a valid state on the signal, for machines that have a
+// matchTransition like PackedFSM's, and -1 for the rest.
+template <class Machine>
+auto traceTransition(const Machine& machine, int state, int signal, int)
+  -> decltype(machine.matchTransition(state, signal)) {
+  return machine.matchTransition(state, signal);
+}
+
+template <class Machine>
+int traceTransition(const Machine&, int, int, long) {
+  return -1;
+}
+
+template <class Machine, class Record>
+bool Cursor::handleSignal(const Machine& machine, int signal, TraceRing<Record>& trace) {
+  if (!trace.sample()) {
+    return handleSignal(machine, signal);
+  }
+  int from = state;
+  int tr = -1;
+  if (state >= 0 && state < machine.countStates()) {
+    tr = traceTransition(machine, state, signal, 0);
+  }
+  bool moved = handleSignal(machine, signal);
+  trace.record(from, signal, moved ? tr : -1, state);
+  return moved;
+}
+
+#endif